@@ -0,0 +1,507 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <cmath>
+#include <ctime>
+#include <cstdio>
+
+#define LIGHT_ASSERT(x) { if (!(x)) __builtin_trap(); }
+
+
+void GetMonotonicTime(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+float GetElapsedTime(struct timespec *before, struct timespec *after) {
+  double delta_s = after->tv_sec - before->tv_sec;
+  double delta_ns = after->tv_nsec - before->tv_nsec;
+  return delta_s * 1e9 + delta_ns;
+}
+
+int FutexWait(int *addr, int expected) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected,
+                 NULL, NULL, 0);
+}
+
+int FutexWake(int *addr, int count) {
+  return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+inline void CpuRelax() {
+  asm volatile("pause" ::: "memory");
+}
+
+
+enum ReleasePolicy {
+  kBarging,         // Unlock frees the lock, whoever gets there first wins
+  kHandoff,         // Unlock passes the lock straight to a sleeping waiter
+  kBoundedBarging,  // Barging until a waiter has been passed over too often
+};
+
+const char *PolicyName(ReleasePolicy policy) {
+  switch (policy) {
+    case kBarging: return "barging";
+    case kHandoff: return "handoff";
+    case kBoundedBarging: return "bounded";
+  }
+  return "unknown";
+}
+
+// Acquisitions that had to queue in LockSlow, per thread, so that the
+// benchmark can tell woken waiters from threads that got in while spinning
+__thread uint64_t t_lock_waits = 0;
+
+// A benaphore whose waiters sleep on a FIFO queue of their own futex words.
+//
+// state_ holds kLocked and kWaiters, the latter set while the queue is not
+// empty. The queue is guarded by queue_lock_, a spinlock that is only held
+// for a few instructions. Unlock pops the oldest waiter, and either
+// releases the lock and lets that waiter race for it again (barging), or
+// leaves state_ locked and makes that waiter the owner (handoff). Spinners
+// only take the lock while kLocked is clear, so nobody can get in front of
+// a waiter the lock was handed to. A waiter that loses the race rejoins
+// at the front of the queue, so the head is always the oldest waiter.
+class Benaphore {
+ public:
+  static const int kSpinCount = 100;
+  static const int kBargeBound = 4;
+
+  explicit Benaphore(ReleasePolicy policy = kBarging)
+      : state_(0), queue_lock_(0), head_(NULL), tail_(NULL), starving_(0),
+        policy_(policy) {
+  }
+  void Lock() {
+    if (TryLock()) {
+      return;
+    }
+    for (int i = 0; i < kSpinCount; ++i) {
+      CpuRelax();
+      if (TryLock()) {
+        return;
+      }
+    }
+    LockSlow();
+  }
+  void Unlock() {
+    if (!__sync_bool_compare_and_swap(&state_, kLocked, 0)) {
+      UnlockSlow();
+    }
+  }
+  bool TryLock() {
+    int s = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+    return !(s & kLocked) &&
+        __sync_bool_compare_and_swap(&state_, s, s | kLocked);
+  }
+
+ private:
+  enum { kLocked = 1, kWaiters = 2 };
+  enum { kAsleep, kRetry, kOwner };
+
+  struct Waiter {
+    int wake;  // kAsleep until Unlock sets kRetry or kOwner
+    Waiter *next;
+  };
+
+  void AcquireQueue() {
+    while (__atomic_exchange_n(&queue_lock_, 1, __ATOMIC_ACQUIRE)) {
+      for (int i = 0; __atomic_load_n(&queue_lock_, __ATOMIC_RELAXED); ++i) {
+        // The holder may have been preempted
+        if (i < kSpinCount) {
+          CpuRelax();
+        } else {
+          sched_yield();
+        }
+      }
+    }
+  }
+  void ReleaseQueue() {
+    __atomic_store_n(&queue_lock_, 0, __ATOMIC_RELEASE);
+  }
+
+  void LockSlow() {
+    Waiter waiter;
+    int passed_over = 0;
+    bool starving = false;
+    bool queued = false;
+    for (;;) {
+      AcquireQueue();
+      int s = __atomic_load_n(&state_, __ATOMIC_RELAXED);
+      for (;;) {
+        if (!(s & kLocked)) {
+          if (__atomic_compare_exchange_n(
+                  &state_, &s, kLocked | (head_ != NULL ? kWaiters : 0),
+                  false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+          }
+        } else if ((s & kWaiters) ||
+                   __atomic_compare_exchange_n(&state_, &s, s | kWaiters,
+                                               false, __ATOMIC_RELAXED,
+                                               __ATOMIC_RELAXED)) {
+          break;
+        }
+      }
+      if (!(s & kLocked)) {
+        ReleaseQueue();
+        break;  // Took it
+      }
+      waiter.wake = kAsleep;
+      waiter.next = NULL;
+      if (queued) {
+        // Woken but beaten to the lock: still the oldest waiter
+        waiter.next = head_;
+        head_ = &waiter;
+        if (tail_ == NULL) {
+          tail_ = &waiter;
+        }
+        if (policy_ == kBoundedBarging && !starving &&
+            ++passed_over >= kBargeBound) {
+          starving = true;
+          __sync_add_and_fetch(&starving_, 1);
+        }
+      } else {
+        if (tail_ != NULL) {
+          tail_->next = &waiter;
+        } else {
+          head_ = &waiter;
+        }
+        tail_ = &waiter;
+      }
+      queued = true;
+      ReleaseQueue();
+      while (__atomic_load_n(&waiter.wake, __ATOMIC_ACQUIRE) == kAsleep) {
+        FutexWait(&waiter.wake, kAsleep);
+      }
+      if (waiter.wake == kOwner) {
+        break;
+      }
+    }
+    if (starving) {
+      __sync_sub_and_fetch(&starving_, 1);
+    }
+    if (queued) {
+      t_lock_waits++;
+    }
+  }
+
+  void UnlockSlow() {
+    AcquireQueue();
+    Waiter *waiter = head_;  // kWaiters is only set while someone queues
+    head_ = waiter->next;
+    if (head_ == NULL) {
+      tail_ = NULL;
+    }
+    int waiters = head_ != NULL ? kWaiters : 0;
+    int wake;
+    if (policy_ == kHandoff ||
+        (policy_ == kBoundedBarging &&
+         __atomic_load_n(&starving_, __ATOMIC_RELAXED) > 0)) {
+      // The lock never looks free, so it can only go to this waiter
+      __atomic_store_n(&state_, kLocked | waiters, __ATOMIC_RELAXED);
+      wake = kOwner;
+    } else {
+      __atomic_store_n(&state_, waiters, __ATOMIC_RELEASE);
+      wake = kRetry;
+    }
+    ReleaseQueue();
+    // The waiter may return, and its frame go away, as soon as it sees
+    // wake; a FUTEX_WAKE on the stale address at worst wakes someone
+    // spuriously, and every wait here rechecks its condition.
+    __atomic_store_n(&waiter->wake, wake, __ATOMIC_RELEASE);
+    FutexWake(&waiter->wake, 1);
+  }
+
+  int state_;
+  int queue_lock_;
+  Waiter *head_;
+  Waiter *tail_;
+  int starving_;  // Waiters passed over kBargeBound times
+  ReleasePolicy policy_;
+};
+
+// Unlike the sem_t version, releasing never needs sem_getvalue: the inner
+// Benaphore already knows whether anybody has to be woken.
+class RecursiveBenaphore {
+ public:
+  explicit RecursiveBenaphore(ReleasePolicy policy = kBarging)
+      : lock_(policy), owner_(0), recursion_(0) {
+  }
+  void Lock() {
+    pthread_t thread_id = pthread_self();
+    if (pthread_equal(thread_id,
+                      __atomic_load_n(&owner_, __ATOMIC_RELAXED))) {
+      recursion_++;
+      return;
+    }
+    lock_.Lock();
+    __atomic_store_n(&owner_, thread_id, __ATOMIC_RELAXED);
+    recursion_ = 1;
+  }
+  void Unlock() {
+    LIGHT_ASSERT(pthread_equal(pthread_self(), owner_));
+    if (--recursion_ == 0) {
+      __atomic_store_n(&owner_, 0, __ATOMIC_RELAXED);
+      lock_.Unlock();
+    }
+  }
+  bool TryLock() {
+    pthread_t thread_id = pthread_self();
+    if (pthread_equal(thread_id,
+                      __atomic_load_n(&owner_, __ATOMIC_RELAXED))) {
+      recursion_++;
+      return true;
+    }
+    if (!lock_.TryLock()) {
+      return false;
+    }
+    __atomic_store_n(&owner_, thread_id, __ATOMIC_RELAXED);
+    recursion_ = 1;
+    return true;
+  }
+
+ private:
+  Benaphore lock_;
+  pthread_t owner_;
+  long recursion_;
+};
+
+
+// Mersenne Twister Parameters
+#define MT_N 624
+#define MT_M 397
+
+class MersenneTwister {
+ public:
+  explicit MersenneTwister(int seed);
+  unsigned int Integer();
+
+ private:
+  unsigned int buffer_[MT_N];
+  int index_;
+};
+
+MersenneTwister::MersenneTwister(int seed) {
+  buffer_[0] = seed;
+  for (index_ = 1; index_ < MT_N; ++index_) {
+    buffer_[index_] = (1812433253UL * (buffer_[index_-1]
+                                       ^ (buffer_[index_-1] >> 30)) + index_);
+  }
+}
+
+unsigned int MersenneTwister::Integer() {
+  if (index_ >= MT_N) {
+    unsigned int i;
+    unsigned int x;
+    for (i = 0; i < MT_N - MT_M; ++i) {
+      x = (buffer_[i] & 0x80000000UL) | (buffer_[i+1] & 0x7fffffffUL);
+      buffer_[i] = buffer_[i+MT_M] ^ (x >> 1) ^ ((x & 1) * 0x9908b0dfUL);
+    }
+    for (; i < MT_N - 1; ++i) {
+      x = (buffer_[i] & 0x80000000UL) | (buffer_[i+1] & 0x7fffffffUL);
+      buffer_[i] = buffer_[i+MT_M-MT_N] ^ (x >> 1) ^ ((x & 1) * 0x9908b0dfUL);
+    }
+    x = (buffer_[MT_N-1] & 0x80000000UL) | (buffer_[0] & 0x7fffffffUL);
+    buffer_[MT_N-1] = buffer_[MT_M-1] ^ (x >> 1) ^ ((x & 1) * 0x9908b0dfUL);
+    index_ = 0;
+  }
+  unsigned int y = buffer_[index_++];
+  y ^= (y >> 11);
+  y ^= (y << 7) & 0x9d2c5680UL;
+  y ^= (y << 15) & 0xefc60000UL;
+  y ^= (y >> 18);
+  return y;
+}
+
+
+// Latencies are kept in a log-scale histogram: four buckets per power of two.
+const int kHistogramBuckets = 4 * 40;
+
+struct ThreadStats {
+  uint64_t acquires;
+  uint64_t handovers;  // Acquisitions from a different previous owner
+  uint64_t wakes;      // Those of them that had to wait in LockSlow
+  uint64_t histogram[kHistogramBuckets];
+};
+
+int HistogramBucket(float ns) {
+  if (ns < 1) {
+    return 0;
+  }
+  int exponent;
+  float mantissa = frexpf(ns, &exponent);  // ns = mantissa * 2^exponent
+  int bucket = exponent * 4 + static_cast<int>((mantissa - 0.5f) * 8);
+  return bucket < kHistogramBuckets ? bucket : kHistogramBuckets - 1;
+}
+
+float HistogramUpperBound(int bucket) {
+  return ldexpf(0.5f + (bucket % 4 + 1) / 8.0f, bucket / 4);
+}
+
+float HistogramPercentile(const ThreadStats &stats, float percentile) {
+  uint64_t total = 0;
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    total += stats.histogram[i];
+  }
+  uint64_t rank = static_cast<uint64_t>(total * percentile);
+  uint64_t seen = 0;
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    seen += stats.histogram[i];
+    if (seen > rank) {
+      return HistogramUpperBound(i);
+    }
+  }
+  return 0;
+}
+
+
+const int kMaxThreads = 4;
+const int kCriticalWork = 20;
+const int kOutsideWork = 200;
+
+ThreadStats g_thread_stats[kMaxThreads];
+
+// Written by the lock holder just before it releases, read by the next one
+struct timespec g_release_time;
+int g_last_owner = -1;
+int g_inside = 0;
+uint64_t g_counter = 0;
+bool g_done = false;
+
+template <class Lock>
+struct ThreadParams {
+  Lock *lock;
+  bool nested;
+  int thread_number;
+};
+
+// Measures unlock-to-running latency: the time from the previous owner
+// stamping g_release_time to this thread coming back from Lock(). Only
+// acquisitions that queued in LockSlow and took the lock from a different
+// thread are counted; a spinner that barges in was never asleep.
+template <class Lock>
+void *ThreadProc(void *param) {
+  ThreadParams<Lock> *params = static_cast<ThreadParams<Lock> *>(param);
+  Lock *lock = params->lock;
+  int thread_number = params->thread_number;
+  MersenneTwister random(thread_number);
+  ThreadStats *stats = &g_thread_stats[thread_number];
+  struct timespec now;
+  while (!__atomic_load_n(&g_done, __ATOMIC_RELAXED)) {
+    int outside = random.Integer() % (2 * kOutsideWork);
+    for (int i = 0; i < outside; ++i) {
+      random.Integer();
+    }
+
+    uint64_t waits = t_lock_waits;
+    lock->Lock();
+    bool woken = t_lock_waits != waits;
+    if (params->nested) {
+      lock->Lock();
+    }
+    GetMonotonicTime(&now);
+    LIGHT_ASSERT(++g_inside == 1);
+    bool handover = g_last_owner >= 0 && g_last_owner != thread_number;
+    float latency = GetElapsedTime(&g_release_time, &now);
+    g_last_owner = thread_number;
+    for (int i = 0; i < kCriticalWork; ++i) {
+      random.Integer();
+    }
+    g_counter++;
+    LIGHT_ASSERT(--g_inside == 0);
+    GetMonotonicTime(&g_release_time);
+    if (params->nested) {
+      lock->Unlock();
+    }
+    lock->Unlock();
+
+    stats->acquires++;
+    if (handover) {
+      stats->handovers++;
+      if (woken) {
+        stats->wakes++;
+        stats->histogram[HistogramBucket(latency)]++;
+      }
+    }
+  }
+  return NULL;
+}
+
+template <class Lock>
+void PerformLatencyTest(const char *lock_name, ReleasePolicy policy,
+                        bool nested, int thread_count, int milliseconds) {
+  Lock lock(policy);
+  g_last_owner = -1;
+  g_counter = 0;
+  g_done = false;
+  for (int t = 0; t < thread_count; ++t) {
+    g_thread_stats[t] = ThreadStats();
+  }
+  pthread_t threads[kMaxThreads];
+  ThreadParams<Lock> params[kMaxThreads];
+  for (int t = 0; t < thread_count; ++t) {
+    params[t].lock = &lock;
+    params[t].nested = nested;
+    params[t].thread_number = t;
+    int rc;
+    rc = pthread_create(&threads[t], NULL, ThreadProc<Lock>, &params[t]);
+    if (rc) {
+      fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+      return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(t, &cpus);
+    pthread_setaffinity_np(threads[t], sizeof(cpu_set_t), &cpus);
+  }
+  usleep(milliseconds * 1000);
+  __atomic_store_n(&g_done, true, __ATOMIC_RELAXED);
+  for (int t = 0; t < thread_count; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+
+  ThreadStats total = ThreadStats();
+  uint64_t min_acquires = g_thread_stats[0].acquires;
+  uint64_t max_acquires = g_thread_stats[0].acquires;
+  for (int t = 0; t < thread_count; ++t) {
+    total.acquires += g_thread_stats[t].acquires;
+    total.handovers += g_thread_stats[t].handovers;
+    total.wakes += g_thread_stats[t].wakes;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+      total.histogram[i] += g_thread_stats[t].histogram[i];
+    }
+    if (g_thread_stats[t].acquires < min_acquires) {
+      min_acquires = g_thread_stats[t].acquires;
+    }
+    if (g_thread_stats[t].acquires > max_acquires) {
+      max_acquires = g_thread_stats[t].acquires;
+    }
+  }
+  LIGHT_ASSERT(total.acquires == g_counter);
+  printf("lock=%s policy=%s threads=%d ", lock_name, PolicyName(policy),
+         thread_count);
+  printf("acquiresPerSec=%e ", total.acquires * 1000.0 / milliseconds);
+  printf("handovers=%" PRIu64 " ", total.handovers);
+  printf("wakes=%" PRIu64 " ", total.wakes);
+  printf("wakeP50Ns=%.0f ", HistogramPercentile(total, 0.5f));
+  printf("wakeP99Ns=%.0f ", HistogramPercentile(total, 0.99f));
+  printf("wakeP999Ns=%.0f ", HistogramPercentile(total, 0.999f));
+  printf("fairness=%f\n", max_acquires ?
+         static_cast<float>(min_acquires) / max_acquires : 0.0f);
+}
+
+
+int main(int argc, char *argv[]) {
+  ReleasePolicy policies[] = { kBarging, kHandoff, kBoundedBarging };
+  for (int p = 0; p < 3; ++p) {
+    for (int thread_count = 2; thread_count <= kMaxThreads; ++thread_count) {
+      PerformLatencyTest<Benaphore>("Benaphore", policies[p], false,
+                                    thread_count, 1000);
+      PerformLatencyTest<RecursiveBenaphore>("RecursiveBenaphore",
+                                             policies[p], true,
+                                             thread_count, 1000);
+    }
+  }
+  return 0;
+}
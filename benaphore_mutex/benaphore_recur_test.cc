@@ -1,11 +1,20 @@
 #include <semaphore.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <ctime>
 #include <cstdio>
 
 #define LIGHT_ASSERT(x) { if (!(x)) __builtin_trap(); }
 
+// Sample per-thread throughput while the stress test runs
+#ifndef USE_TIMELINE
+#define USE_TIMELINE 0
+#endif
+#ifndef TIMELINE_INTERVAL_US
+#define TIMELINE_INTERVAL_US 10000
+#endif
+
 class RecursiveBenaphore {
  public:
   RecursiveBenaphore() : counter_(0), owner_(0), recursion_(0) {
@@ -115,9 +124,9 @@ unsigned int MersenneTwister::Integer() {
 }
 
 struct ThreadStats {
-  int iterations;
-  int work_units_complete;
-  int amount_incremented;
+  uint64_t iterations;
+  uint64_t work_units_complete;
+  uint64_t amount_incremented;
 
   ThreadStats() {
     iterations = 0;
@@ -133,21 +142,125 @@ struct ThreadStats {
 };
 
 
+// Counters a worker publishes while it runs. Each thread owns a whole cache
+// line, so the monitor reading them never false-shares with another worker.
+struct LiveCounters {
+  uint64_t iterations;
+  uint64_t work_units_complete;
+} __attribute__((aligned(64)));
+
+
 const int kMaxThreads = 4;
 ThreadStats g_thread_stats[kMaxThreads];
+LiveCounters g_live_counters[kMaxThreads];
 
 RecursiveBenaphore g_lock;
 
-int g_counter = 0;
+uint64_t g_counter = 0;
 bool g_done = false;
 
+void GetMonotonicTime(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+float GetElapsedTime(struct timespec *before, struct timespec *after) {
+  double delta_s = after->tv_sec - before->tv_sec;
+  double delta_ns = after->tv_nsec - before->tv_nsec;
+  return delta_s + delta_ns * 1e-9;
+}
+
+#if USE_TIMELINE
+const int kMaxTimelineSamples = 4096;
+
+struct TimelineSample {
+  float time;
+  uint64_t iterations[kMaxThreads];
+  uint64_t work_units_complete[kMaxThreads];
+};
+
+struct Timeline {
+  int thread_count;
+  int sample_count;
+  bool done;
+  float sample_cost;  // Seconds spent reading the counters
+  float monitor_cpu;  // CPU seconds used by the monitor thread
+  float elapsed_time;
+  TimelineSample samples[kMaxTimelineSamples];
+};
+
+Timeline g_timeline;
+
+void TakeTimelineSample(struct timespec *start) {
+  struct timespec now, end;
+  GetMonotonicTime(&now);
+  TimelineSample *sample = &g_timeline.samples[g_timeline.sample_count++];
+  sample->time = GetElapsedTime(start, &now);
+  for (int t = 0; t < g_timeline.thread_count; ++t) {
+    LiveCounters *live = &g_live_counters[t];
+    sample->iterations[t] = __atomic_load_n(&live->iterations,
+                                            __ATOMIC_RELAXED);
+    sample->work_units_complete[t] =
+        __atomic_load_n(&live->work_units_complete, __ATOMIC_RELAXED);
+  }
+  GetMonotonicTime(&end);
+  g_timeline.sample_cost += GetElapsedTime(&now, &end);
+}
+
+// Wakes up every TIMELINE_INTERVAL_US on an absolute schedule, so a late
+// sample does not shift the ones after it.
+void *MonitorProc(void *param) {
+  struct timespec start, next, end, cpu_start, cpu_end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+  GetMonotonicTime(&start);
+  next = start;
+  TakeTimelineSample(&start);
+  while (!__atomic_load_n(&g_timeline.done, __ATOMIC_ACQUIRE) &&
+         g_timeline.sample_count < kMaxTimelineSamples) {
+    next.tv_nsec += TIMELINE_INTERVAL_US * 1000L;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    TakeTimelineSample(&start);
+  }
+  GetMonotonicTime(&end);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+  g_timeline.elapsed_time = GetElapsedTime(&start, &end);
+  g_timeline.monitor_cpu = GetElapsedTime(&cpu_start, &cpu_end);
+  return NULL;
+}
+
+void ReportTimeline() {
+  for (int i = 1; i < g_timeline.sample_count; ++i) {
+    TimelineSample *prev = &g_timeline.samples[i - 1];
+    TimelineSample *sample = &g_timeline.samples[i];
+    float interval = sample->time - prev->time;
+    for (int t = 0; t < g_timeline.thread_count; ++t) {
+      printf("timeline time=%f thread=%d iterationRate=%e workRate=%e\n",
+             sample->time, t,
+             (sample->iterations[t] - prev->iterations[t]) / interval,
+             (sample->work_units_complete[t] -
+              prev->work_units_complete[t]) / interval);
+    }
+  }
+  printf("timeline overhead: %d samples, %e s per sample, "
+         "monitor load %f\n", g_timeline.sample_count,
+         g_timeline.sample_cost / g_timeline.sample_count,
+         g_timeline.monitor_cpu / g_timeline.elapsed_time);
+}
+#endif
+
 void *ThreadProc(void *param) {
   ThreadStats local_state;
   int thread_number = *(static_cast<int *>(param));
   MersenneTwister random(thread_number);
   int lock_count = 0;
-  int last_counter = 0;
+  uint64_t last_counter = 0;
   LIGHT_ASSERT(thread_number < kMaxThreads);
+#if USE_TIMELINE
+  LiveCounters *live = &g_live_counters[thread_number];
+#endif
   for (;;) {
     local_state.iterations++;
     float f = random.fraction();
@@ -156,6 +269,13 @@ void *ThreadProc(void *param) {
       random.Integer();
     }
     local_state.work_units_complete += work_units;
+#if USE_TIMELINE
+    // Single writer, so a relaxed store is enough: a plain mov on x86
+    __atomic_store_n(&live->iterations, local_state.iterations,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&live->work_units_complete,
+                     local_state.work_units_complete, __ATOMIC_RELAXED);
+#endif
 
     if (lock_count > 0) {
       LIGHT_ASSERT(g_counter == last_counter);
@@ -181,7 +301,7 @@ void *ThreadProc(void *param) {
     }
 
     if (lock_count > 0) {
-      LIGHT_ASSERT((g_counter - last_counter) >= 0);
+      LIGHT_ASSERT(g_counter >= last_counter);
       g_counter += thread_number + 1;
       last_counter = g_counter;
       local_state.amount_incremented += thread_number + 1;
@@ -207,6 +327,10 @@ void PerformStressTest(int thread_count, bool use_affinities,
          thread_count, use_affinities? "with" : "without", milliseconds);
   pthread_t threads[kMaxThreads];
   int thread_ids[kMaxThreads];
+  for (int t = 0; t < thread_count; ++t) {
+    g_live_counters[t].iterations = 0;
+    g_live_counters[t].work_units_complete = 0;
+  }
   for (int t = 0; t < thread_count; ++t) {
     thread_ids[t] = t;
     int rc;
@@ -223,20 +347,36 @@ void PerformStressTest(int thread_count, bool use_affinities,
       pthread_setaffinity_np(threads[t], sizeof(cpu_set_t), &cpus);
     }
   }
+#if USE_TIMELINE
+  pthread_t monitor;
+  g_timeline.thread_count = thread_count;
+  g_timeline.sample_count = 0;
+  g_timeline.sample_cost = 0;
+  g_timeline.done = false;
+  pthread_create(&monitor, NULL, MonitorProc, NULL);
+#endif
   usleep(milliseconds * 1000);
   g_done = true;
 
   for (int t = 0; t < thread_count; ++t) {
     pthread_join(threads[t], NULL);
   }
+#if USE_TIMELINE
+  __atomic_store_n(&g_timeline.done, true, __ATOMIC_RELEASE);
+  pthread_join(monitor, NULL);
+#endif
 
   ThreadStats total_stats;
   for (int t = 0; t < thread_count; ++t) {
     total_stats.Accumulate(g_thread_stats[t]);
   }
   LIGHT_ASSERT(total_stats.amount_incremented == g_counter);
-  printf("%d total iterations, %d workUnits, g_counter=%d\n",
-         total_stats.iterations, total_stats.work_units_complete, g_counter);
+  printf("%" PRIu64 " total iterations, %" PRIu64 " workUnits, "
+         "g_counter=%" PRIu64 "\n", total_stats.iterations,
+         total_stats.work_units_complete, g_counter);
+#if USE_TIMELINE
+  ReportTimeline();
+#endif
 }
 
 
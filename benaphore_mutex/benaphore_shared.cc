@@ -0,0 +1,347 @@
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <ctime>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+
+
+void GetMonotonicTime(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+float GetElapsedTime(struct timespec *before, struct timespec *after) {
+  double delta_s = after->tv_sec - before->tv_sec;
+  double delta_ns = after->tv_nsec - before->tv_nsec;
+  return delta_s * 1e9 + delta_ns;
+}
+
+
+#define LIGHT_ASSERT(x) { if (!(x)) __builtin_trap(); }
+
+// No FUTEX_PRIVATE_FLAG: the kernel has to key the futex on the shared
+// page, not on this process' address space.
+int FutexWait(int *addr, int expected, const struct timespec *timeout) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+int FutexWake(int *addr, int count) {
+  return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+__thread int t_tid = 0;
+__thread bool t_robust_list_registered = false;
+__thread struct robust_list_head t_robust_list;
+
+// A forked child starts with its parent's thread locals, so the cached tid
+// has to be dropped on fork. The kernel does not carry the robust list
+// registration over either, and the child holds none of the parent's locks.
+void ResetThreadCaches() {
+  t_tid = 0;
+  t_robust_list_registered = false;
+}
+
+struct ThreadCacheReset {
+  ThreadCacheReset() {
+    pthread_atfork(NULL, NULL, ResetThreadCaches);
+  }
+} g_thread_cache_reset;
+
+int CurrentTid() {
+  if (t_tid == 0) {
+    t_tid = syscall(SYS_gettid);
+  }
+  return t_tid;
+}
+
+
+// A benaphore that can live in memory shared between processes.
+//
+// The lock word holds the owner's tid, plus FUTEX_WAITERS once somebody may
+// be asleep on it: a robust futex. An all-zero object is a valid unlocked
+// lock, so a freshly ftruncate()d shared memory segment needs no further
+// initialization.
+//
+// Every lock a thread holds is linked into that thread's robust list.
+// When the thread dies, the kernel walks the list, replaces the tid in
+// each lock word with FUTEX_OWNER_DIED and wakes a waiter. The next Lock()
+// then gets EOWNERDEAD, just like a robust pthread mutex: the data it
+// protects may be half-updated. A thread has only one robust list, and
+// this one replaces glibc's, so robust pthread mutexes cannot be used on
+// the same thread.
+class SharedBenaphore {
+ public:
+  SharedBenaphore() {
+    node_.next = NULL;
+    word_ = 0;
+  }
+  // Returns 0, or EOWNERDEAD if the lock was taken from a dead owner
+  int Lock() {
+    int tid = CurrentTid();
+    SetPendingOp(&node_);
+    int result = 0;
+    if (!__sync_bool_compare_and_swap(&word_, 0, tid)) {
+      result = LockSlow(tid);
+    }
+    node_.next = t_robust_list.list.next;
+    t_robust_list.list.next = &node_;
+    SetPendingOp(NULL);
+    return result;
+  }
+  void Unlock() {
+    int tid = CurrentTid();
+    LIGHT_ASSERT((word_ & FUTEX_TID_MASK) == tid);
+    SetPendingOp(&node_);
+    struct robust_list *prev = &t_robust_list.list;
+    while (prev->next != &node_) {
+      prev = prev->next;
+    }
+    prev->next = node_.next;
+    if (!__sync_bool_compare_and_swap(&word_, tid, 0)) {
+      __atomic_store_n(&word_, 0, __ATOMIC_RELEASE);
+      FutexWake(&word_, 1);
+    }
+    SetPendingOp(NULL);
+  }
+  // Never recovers a dead owner's lock; only Lock() reports EOWNERDEAD
+  bool TryLock() {
+    int tid = CurrentTid();
+    SetPendingOp(&node_);
+    bool locked = __sync_bool_compare_and_swap(&word_, 0, tid);
+    if (locked) {
+      node_.next = t_robust_list.list.next;
+      t_robust_list.list.next = &node_;
+    }
+    SetPendingOp(NULL);
+    return locked;
+  }
+  int Owner() {
+    return __atomic_load_n(&word_, __ATOMIC_RELAXED) & FUTEX_TID_MASK;
+  }
+
+ private:
+  // The kernel walks the list from the dying thread itself, so the list
+  // and the lock word only have to be updated in program order, which the
+  // signal fences keep the compiler to. list_op_pending covers a thread
+  // that dies between taking or releasing the lock word and relinking.
+  static void SetPendingOp(struct robust_list *node) {
+    if (!t_robust_list_registered) {
+      t_robust_list.list.next = &t_robust_list.list;
+      t_robust_list.futex_offset =
+          offsetof(SharedBenaphore, word_) - offsetof(SharedBenaphore, node_);
+      t_robust_list.list_op_pending = NULL;
+      LIGHT_ASSERT(syscall(SYS_set_robust_list, &t_robust_list,
+                           sizeof(t_robust_list)) == 0);
+      t_robust_list_registered = true;
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    t_robust_list.list_op_pending = node;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  }
+
+  int LockSlow(int tid) {
+    for (;;) {
+      int value = __atomic_load_n(&word_, __ATOMIC_RELAXED);
+      if ((value & FUTEX_TID_MASK) == 0) {
+        // We cannot tell whether anyone else is asleep, so keep the bit
+        if (__sync_bool_compare_and_swap(&word_, value, tid | FUTEX_WAITERS)) {
+          return (value & FUTEX_OWNER_DIED) ? EOWNERDEAD : 0;
+        }
+        continue;
+      }
+      if (!(value & FUTEX_WAITERS)) {
+        if (!__sync_bool_compare_and_swap(&word_, value,
+                                          value | FUTEX_WAITERS)) {
+          continue;
+        }
+        value |= FUTEX_WAITERS;
+      }
+      FutexWait(&word_, value, NULL);
+    }
+  }
+
+  // The kernel finds word_ at futex_offset from the list node
+  struct robust_list node_;
+  int word_;
+};
+
+class RecursiveSharedBenaphore {
+ public:
+  RecursiveSharedBenaphore() : recursion_(0) {
+  }
+  int Lock() {
+    if (lock_.Owner() == CurrentTid()) {
+      recursion_++;
+      return 0;
+    }
+    int result = lock_.Lock();
+    // On EOWNERDEAD the dead owner's recursion count is meaningless
+    recursion_ = 1;
+    return result;
+  }
+  void Unlock() {
+    LIGHT_ASSERT(lock_.Owner() == CurrentTid());
+    if (--recursion_ == 0) {
+      lock_.Unlock();
+    }
+  }
+  bool TryLock() {
+    if (lock_.Owner() == CurrentTid()) {
+      recursion_++;
+      return true;
+    }
+    if (!lock_.TryLock()) {
+      return false;
+    }
+    recursion_ = 1;
+    return true;
+  }
+
+ private:
+  SharedBenaphore lock_;
+  long recursion_;
+};
+
+
+// Maps the named POSIX shared memory object, creating it zero-filled if it
+// does not exist yet.
+void *MapSharedRegion(const char *name, size_t size) {
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    perror("shm_open");
+    exit(1);
+  }
+  if (ftruncate(fd, size) < 0) {
+    perror("ftruncate");
+    exit(1);
+  }
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return addr;
+}
+
+struct SharedState {
+  SharedBenaphore lock;
+  RecursiveSharedBenaphore recursive_lock;
+  uint64_t counter;
+};
+
+const char *kRegionName = "/benaphore_shared_test";
+const int kProcesses = 4;
+const int kN = 1000000;
+
+// Every worker maps the segment again by name, at whatever address it
+// gets, rather than relying on the mapping inherited through fork.
+void Worker(bool recursive) {
+  SharedState *state = static_cast<SharedState *>(
+      MapSharedRegion(kRegionName, sizeof(SharedState)));
+  for (int i = 0; i < kN; ++i) {
+    if (recursive) {
+      state->recursive_lock.Lock();
+      state->recursive_lock.Lock();
+      state->counter++;
+      state->recursive_lock.Unlock();
+      state->recursive_lock.Unlock();
+    } else {
+      state->lock.Lock();
+      state->counter++;
+      state->lock.Unlock();
+    }
+  }
+}
+
+void PerformStressTest(SharedState *state, bool recursive) {
+  struct timespec start, end;
+  state->counter = 0;
+  GetMonotonicTime(&start);
+  pid_t pids[kProcesses];
+  for (int p = 0; p < kProcesses; ++p) {
+    pids[p] = fork();
+    if (pids[p] == 0) {
+      Worker(recursive);
+      _exit(0);
+    }
+    if (pids[p] < 0) {
+      perror("fork");
+      exit(1);
+    }
+  }
+  for (int p = 0; p < kProcesses; ++p) {
+    waitpid(pids[p], NULL, 0);
+  }
+  GetMonotonicTime(&end);
+  LIGHT_ASSERT(state->counter == static_cast<uint64_t>(kProcesses) * kN);
+  printf("%s: %d processes, the average time of lock is %e\n",
+         recursive ? "RecursiveSharedBenaphore" : "SharedBenaphore",
+         kProcesses, GetElapsedTime(&start, &end) / (kProcesses * kN));
+}
+
+// A child takes the lock and exits without releasing it. It is left
+// unreaped until we have the lock, so the lock has to see through a zombie.
+void PerformOwnerDeathTest(SharedState *state, bool recursive) {
+  int locked[2];
+  if (pipe(locked) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (recursive) {
+      state->recursive_lock.Lock();
+      state->recursive_lock.Lock();
+    } else {
+      state->lock.Lock();
+    }
+    char byte = 1;
+    write(locked[1], &byte, 1);
+    _exit(0);
+  }
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  // Only try the lock once the child is known to hold it
+  close(locked[1]);
+  char byte;
+  LIGHT_ASSERT(read(locked[0], &byte, 1) == 1);
+  close(locked[0]);
+  struct timespec start, end;
+  GetMonotonicTime(&start);
+  int result = recursive ? state->recursive_lock.Lock() : state->lock.Lock();
+  GetMonotonicTime(&end);
+  LIGHT_ASSERT(result == EOWNERDEAD);
+  if (recursive) {
+    state->recursive_lock.Unlock();
+  } else {
+    state->lock.Unlock();
+  }
+  waitpid(pid, NULL, 0);
+  printf("%s: recovered from dead owner in %e ns\n",
+         recursive ? "RecursiveSharedBenaphore" : "SharedBenaphore",
+         GetElapsedTime(&start, &end));
+}
+
+
+int main(int argc, char *argv[]) {
+  shm_unlink(kRegionName);
+  SharedState *state = static_cast<SharedState *>(
+      MapSharedRegion(kRegionName, sizeof(SharedState)));
+  for (int recursive = 0; recursive < 2; ++recursive) {
+    PerformStressTest(state, recursive);
+    PerformOwnerDeathTest(state, recursive);
+  }
+  shm_unlink(kRegionName);
+  return 0;
+}
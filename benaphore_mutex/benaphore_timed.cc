@@ -0,0 +1,468 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <cmath>
+#include <ctime>
+#include <cstdio>
+
+#define LIGHT_ASSERT(x) { if (!(x)) __builtin_trap(); }
+
+
+void GetMonotonicTime(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+float GetElapsedTime(struct timespec *before, struct timespec *after) {
+  double delta_s = after->tv_sec - before->tv_sec;
+  double delta_ns = after->tv_nsec - before->tv_nsec;
+  return delta_s * 1e9 + delta_ns;
+}
+
+void AddNanoseconds(struct timespec *ts, long ns) {
+  ts->tv_sec += ns / 1000000000L;
+  ts->tv_nsec += ns % 1000000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_nsec -= 1000000000L;
+    ts->tv_sec++;
+  }
+}
+
+// Whether deadline, on the CLOCK_MONOTONIC clock, is in the past
+bool DeadlinePassed(const struct timespec &deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > deadline.tv_sec ||
+      (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+// FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, unlike
+// FUTEX_WAIT's relative timeout, so retries after a spurious wakeup do not
+// push the deadline back. A NULL deadline waits forever.
+int FutexWaitUntil(int *addr, int expected, const struct timespec *deadline) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, expected,
+                 deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+int FutexWake(int *addr, int count) {
+  return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+inline void CpuRelax() {
+  asm volatile("pause" ::: "memory");
+}
+
+
+// The Benaphore of benaphore.cc, with the sem_t replaced by a futex on a
+// token count so that waiting can time out.
+//
+// counter_ is the number of threads that hold or wait for the lock. An
+// Unlock that leaves it above zero posts a token, and the waiter that takes
+// the token owns the lock. A waiter that times out has to take its
+// increment back without breaking that: if it is the only thread left in
+// counter_, the previous owner has already committed to posting a token
+// for it, so it waits for that token instead of leaving. Otherwise it
+// leaves, and since a token posted meanwhile may have woken it rather than
+// the waiter who now needs it, it passes the wakeup on.
+class Benaphore {
+ public:
+  static const int kSpinCount = 100;
+  static const int kDeadlineCheckInterval = 16;  // Spins between clock reads
+
+  Benaphore() : counter_(0), tokens_(0), sleepers_(0) {
+  }
+  void Lock() {
+    if (__sync_add_and_fetch(&counter_, 1) > 1) {
+      WaitForToken(NULL);
+    }
+  }
+  void Unlock() {
+    if (__sync_sub_and_fetch(&counter_, 1) > 0) {
+      __sync_fetch_and_add(&tokens_, 1);
+      if (__atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST) > 0) {
+        FutexWake(&tokens_, 1);
+      }
+    }
+  }
+  bool TryLock() {
+    return __sync_bool_compare_and_swap(&counter_, 0, 1);
+  }
+  // Returns false if the lock could not be taken by deadline, which is
+  // on the CLOCK_MONOTONIC clock.
+  bool TryLockUntil(const struct timespec &deadline) {
+    // Spinning does not touch counter_, so giving up here needs no undo,
+    // and once the deadline has passed we give up after a single CAS
+    for (int i = 0; i <= kSpinCount; ++i) {
+      if (__atomic_load_n(&counter_, __ATOMIC_RELAXED) == 0 &&
+          __sync_bool_compare_and_swap(&counter_, 0, 1)) {
+        return true;
+      }
+      if (i % kDeadlineCheckInterval == 0 && DeadlinePassed(deadline)) {
+        return false;
+      }
+      CpuRelax();
+    }
+    if (__sync_add_and_fetch(&counter_, 1) == 1 ||
+        WaitForToken(&deadline)) {
+      return true;
+    }
+    long c = __atomic_load_n(&counter_, __ATOMIC_RELAXED);
+    for (;;) {
+      if (c == 1) {
+        // Our token is on its way; take the lock, if a little late
+        WaitForToken(NULL);
+        return true;
+      }
+      if (__atomic_compare_exchange_n(&counter_, &c, c - 1, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    if (__atomic_load_n(&tokens_, __ATOMIC_SEQ_CST) > 0 &&
+        __atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST) > 0) {
+      FutexWake(&tokens_, 1);
+    }
+    return false;
+  }
+  bool TryLockFor(long ns) {
+    struct timespec deadline;
+    GetMonotonicTime(&deadline);
+    AddNanoseconds(&deadline, ns);
+    return TryLockUntil(deadline);
+  }
+  // Nobody holds or waits for the lock, and no token is left over
+  bool IsIdle() {
+    return __atomic_load_n(&counter_, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&tokens_, __ATOMIC_SEQ_CST) == 0;
+  }
+
+ private:
+  bool TakeToken() {
+    int t = __atomic_load_n(&tokens_, __ATOMIC_RELAXED);
+    while (t > 0) {
+      if (__atomic_compare_exchange_n(&tokens_, &t, t - 1, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  // Returns false once deadline has passed without a token
+  bool WaitForToken(const struct timespec *deadline) {
+    while (!TakeToken()) {
+      // Unlock reads sleepers_ after posting, we read tokens_ (in the
+      // kernel) after announcing ourselves: one of us sees the other
+      __sync_fetch_and_add(&sleepers_, 1);
+      int result = FutexWaitUntil(&tokens_, 0, deadline);
+      __sync_fetch_and_sub(&sleepers_, 1);
+      if (result == -1 && errno == ETIMEDOUT) {
+        return TakeToken();
+      }
+    }
+    return true;
+  }
+
+  long counter_;
+  int tokens_;
+  int sleepers_;
+};
+
+class RecursiveBenaphore {
+ public:
+  RecursiveBenaphore() : owner_(0), recursion_(0) {
+  }
+  void Lock() {
+    if (Reenter()) {
+      return;
+    }
+    lock_.Lock();
+    Enter();
+  }
+  void Unlock() {
+    LIGHT_ASSERT(pthread_equal(pthread_self(), owner_));
+    if (--recursion_ == 0) {
+      __atomic_store_n(&owner_, 0, __ATOMIC_RELAXED);
+      lock_.Unlock();
+    }
+  }
+  bool TryLock() {
+    if (Reenter()) {
+      return true;
+    }
+    if (!lock_.TryLock()) {
+      return false;
+    }
+    Enter();
+    return true;
+  }
+  bool TryLockUntil(const struct timespec &deadline) {
+    if (Reenter()) {
+      return true;
+    }
+    if (!lock_.TryLockUntil(deadline)) {
+      return false;
+    }
+    Enter();
+    return true;
+  }
+  bool TryLockFor(long ns) {
+    struct timespec deadline;
+    GetMonotonicTime(&deadline);
+    AddNanoseconds(&deadline, ns);
+    return TryLockUntil(deadline);
+  }
+  bool IsIdle() {
+    return lock_.IsIdle();
+  }
+
+ private:
+  bool Reenter() {
+    if (pthread_equal(pthread_self(),
+                      __atomic_load_n(&owner_, __ATOMIC_RELAXED))) {
+      recursion_++;
+      return true;
+    }
+    return false;
+  }
+  void Enter() {
+    __atomic_store_n(&owner_, pthread_self(), __ATOMIC_RELAXED);
+    recursion_ = 1;
+  }
+
+  Benaphore lock_;
+  pthread_t owner_;
+  long recursion_;
+};
+
+
+// Mersenne Twister Parameters
+#define MT_N 624
+#define MT_M 397
+
+class MersenneTwister {
+ public:
+  explicit MersenneTwister(int seed);
+  unsigned int Integer();
+
+ private:
+  unsigned int buffer_[MT_N];
+  int index_;
+};
+
+MersenneTwister::MersenneTwister(int seed) {
+  buffer_[0] = seed;
+  for (index_ = 1; index_ < MT_N; ++index_) {
+    buffer_[index_] = (1812433253UL * (buffer_[index_-1]
+                                       ^ (buffer_[index_-1] >> 30)) + index_);
+  }
+}
+
+unsigned int MersenneTwister::Integer() {
+  if (index_ >= MT_N) {
+    unsigned int i;
+    unsigned int x;
+    for (i = 0; i < MT_N - MT_M; ++i) {
+      x = (buffer_[i] & 0x80000000UL) | (buffer_[i+1] & 0x7fffffffUL);
+      buffer_[i] = buffer_[i+MT_M] ^ (x >> 1) ^ ((x & 1) * 0x9908b0dfUL);
+    }
+    for (; i < MT_N - 1; ++i) {
+      x = (buffer_[i] & 0x80000000UL) | (buffer_[i+1] & 0x7fffffffUL);
+      buffer_[i] = buffer_[i+MT_M-MT_N] ^ (x >> 1) ^ ((x & 1) * 0x9908b0dfUL);
+    }
+    x = (buffer_[MT_N-1] & 0x80000000UL) | (buffer_[0] & 0x7fffffffUL);
+    buffer_[MT_N-1] = buffer_[MT_M-1] ^ (x >> 1) ^ ((x & 1) * 0x9908b0dfUL);
+    index_ = 0;
+  }
+  unsigned int y = buffer_[index_++];
+  y ^= (y >> 11);
+  y ^= (y << 7) & 0x9d2c5680UL;
+  y ^= (y << 15) & 0xefc60000UL;
+  y ^= (y >> 18);
+  return y;
+}
+
+
+// Latencies are kept in a log-scale histogram: four buckets per power of two.
+const int kHistogramBuckets = 4 * 40;
+
+struct ThreadStats {
+  uint64_t acquires;
+  uint64_t timeouts;
+  uint64_t late_acquires;  // Succeeded, but after the deadline
+  uint64_t histogram[kHistogramBuckets];  // Time spent acquiring
+};
+
+int HistogramBucket(float ns) {
+  if (ns < 1) {
+    return 0;
+  }
+  int exponent;
+  float mantissa = frexpf(ns, &exponent);  // ns = mantissa * 2^exponent
+  int bucket = exponent * 4 + static_cast<int>((mantissa - 0.5f) * 8);
+  return bucket < kHistogramBuckets ? bucket : kHistogramBuckets - 1;
+}
+
+float HistogramUpperBound(int bucket) {
+  return ldexpf(0.5f + (bucket % 4 + 1) / 8.0f, bucket / 4);
+}
+
+float HistogramPercentile(const ThreadStats &stats, float percentile) {
+  uint64_t total = 0;
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    total += stats.histogram[i];
+  }
+  uint64_t rank = static_cast<uint64_t>(total * percentile);
+  uint64_t seen = 0;
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    seen += stats.histogram[i];
+    if (seen > rank) {
+      return HistogramUpperBound(i);
+    }
+  }
+  return 0;
+}
+
+
+const int kMaxThreads = 4;
+const int kCriticalWork = 200;
+const int kOutsideWork = 200;
+
+ThreadStats g_thread_stats[kMaxThreads];
+
+int g_inside = 0;
+uint64_t g_counter = 0;
+bool g_done = false;
+
+template <class Lock>
+struct ThreadParams {
+  Lock *lock;
+  bool nested;
+  long timeout_ns;
+  int thread_number;
+};
+
+// Two out of three acquisitions are timed, the rest block, so that timed
+// waiters withdraw while untimed ones are queued next to them.
+template <class Lock>
+void *ThreadProc(void *param) {
+  ThreadParams<Lock> *params = static_cast<ThreadParams<Lock> *>(param);
+  Lock *lock = params->lock;
+  int thread_number = params->thread_number;
+  MersenneTwister random(thread_number);
+  ThreadStats *stats = &g_thread_stats[thread_number];
+  struct timespec start, deadline, end;
+  while (!__atomic_load_n(&g_done, __ATOMIC_RELAXED)) {
+    int outside = random.Integer() % (2 * kOutsideWork);
+    for (int i = 0; i < outside; ++i) {
+      random.Integer();
+    }
+
+    bool timed = random.Integer() % 3 != 0;
+    GetMonotonicTime(&start);
+    deadline = start;
+    AddNanoseconds(&deadline, params->timeout_ns);
+    bool locked = true;
+    if (timed) {
+      locked = lock->TryLockUntil(deadline);
+    } else {
+      lock->Lock();
+    }
+    GetMonotonicTime(&end);
+    if (timed) {
+      stats->histogram[HistogramBucket(GetElapsedTime(&start, &end))]++;
+    }
+    if (!locked) {
+      stats->timeouts++;
+      continue;
+    }
+    if (timed && GetElapsedTime(&deadline, &end) > 0) {
+      stats->late_acquires++;
+    }
+    if (params->nested) {
+      LIGHT_ASSERT(lock->TryLockFor(0));
+    }
+    LIGHT_ASSERT(++g_inside == 1);
+    for (int i = 0; i < kCriticalWork; ++i) {
+      random.Integer();
+    }
+    g_counter++;
+    LIGHT_ASSERT(--g_inside == 0);
+    if (params->nested) {
+      lock->Unlock();
+    }
+    lock->Unlock();
+    stats->acquires++;
+  }
+  return NULL;
+}
+
+template <class Lock>
+void PerformTimeoutTest(const char *lock_name, bool nested, int thread_count,
+                        long timeout_ns, int milliseconds) {
+  Lock lock;
+  g_counter = 0;
+  g_done = false;
+  for (int t = 0; t < thread_count; ++t) {
+    g_thread_stats[t] = ThreadStats();
+  }
+  pthread_t threads[kMaxThreads];
+  ThreadParams<Lock> params[kMaxThreads];
+  for (int t = 0; t < thread_count; ++t) {
+    params[t].lock = &lock;
+    params[t].nested = nested;
+    params[t].timeout_ns = timeout_ns;
+    params[t].thread_number = t;
+    int rc;
+    rc = pthread_create(&threads[t], NULL, ThreadProc<Lock>, &params[t]);
+    if (rc) {
+      fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+      return;
+    }
+  }
+  usleep(milliseconds * 1000);
+  __atomic_store_n(&g_done, true, __ATOMIC_RELAXED);
+  for (int t = 0; t < thread_count; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+
+  ThreadStats total = ThreadStats();
+  for (int t = 0; t < thread_count; ++t) {
+    total.acquires += g_thread_stats[t].acquires;
+    total.timeouts += g_thread_stats[t].timeouts;
+    total.late_acquires += g_thread_stats[t].late_acquires;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+      total.histogram[i] += g_thread_stats[t].histogram[i];
+    }
+  }
+  // Every withdrawal took its count back and left no token behind
+  LIGHT_ASSERT(total.acquires == g_counter);
+  LIGHT_ASSERT(lock.IsIdle());
+  uint64_t attempts = total.acquires + total.timeouts;
+  printf("lock=%s threads=%d timeoutNs=%ld ", lock_name, thread_count,
+         timeout_ns);
+  printf("acquires=%" PRIu64 " timeouts=%" PRIu64 " ", total.acquires,
+         total.timeouts);
+  printf("timeoutRate=%f ", attempts ?
+         static_cast<float>(total.timeouts) / attempts : 0.0f);
+  printf("lateAcquires=%" PRIu64 " ", total.late_acquires);
+  printf("waitP50Ns=%.0f ", HistogramPercentile(total, 0.5f));
+  printf("waitP99Ns=%.0f ", HistogramPercentile(total, 0.99f));
+  printf("waitP999Ns=%.0f\n", HistogramPercentile(total, 0.999f));
+}
+
+
+int main(int argc, char *argv[]) {
+  long timeouts_ns[] = { 0, 1000, 10000, 100000 };
+  for (int i = 0; i < 4; ++i) {
+    for (int thread_count = 2; thread_count <= kMaxThreads; ++thread_count) {
+      PerformTimeoutTest<Benaphore>("Benaphore", false, thread_count,
+                                    timeouts_ns[i], 500);
+      PerformTimeoutTest<RecursiveBenaphore>("RecursiveBenaphore", true,
+                                             thread_count, timeouts_ns[i],
+                                             500);
+    }
+  }
+  return 0;
+}
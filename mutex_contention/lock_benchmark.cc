@@ -1,11 +1,97 @@
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include <cmath>
 #include <ctime>
+#include <cstddef>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
 using std::min;
 
 typedef long long int uint64_t;
+
+// Lock guarding the critical section
+#define LOCK_PTHREAD_MUTEX 0
+#define LOCK_SHARED_BENAPHORE 1
+#define LOCK_COHORT 2
+#define LOCK_SPIN 3
+#define LOCK_SPIN_PAUSE 4
+#define LOCK_SPIN_EXPONENTIAL 5
+#define LOCK_SPIN_YIELD 6
+#define LOCK_TIMED_BENAPHORE 7
+#ifndef USE_LOCK
+#define USE_LOCK LOCK_PTHREAD_MUTEX
+#endif
+
+// Cohort lock: number of emulated domains (0 reads them from /sys), and how
+// many times in a row the lock may stay within one domain
+#ifndef COHORT_DOMAINS
+#define COHORT_DOMAINS 0
+#endif
+#ifndef COHORT_PASS_BOUND
+#define COHORT_PASS_BOUND 64
+#endif
+
+// Timed benaphore: how long a worker waits for the lock before it gives up
+// and skips that critical section
+#ifndef TIMED_LOCK_DEADLINE_US
+#define TIMED_LOCK_DEADLINE_US 10
+#endif
+
+// Seconds per benchmark point, and lock durations swept per lock interval
+#ifndef BENCHMARK_TIME_LIMIT
+#define BENCHMARK_TIME_LIMIT 1.0f
+#endif
+#ifndef BENCHMARK_STEPS
+#define BENCHMARK_STEPS 200
+#endif
+
+// Times each step of each point is run; the runs are reported separately
+// so that results can be compared statistically
+#ifndef BENCHMARK_REPETITIONS
+#define BENCHMARK_REPETITIONS 1
+#endif
+
+// Cores per partition when independent points run concurrently
+// (--concurrent), and whether partitions may share an L3 cache
+#ifndef SWEEP_PARTITION_CPUS
+#define SWEEP_PARTITION_CPUS 4
+#endif
+#ifndef SWEEP_SHARED_L3
+#define SWEEP_SHARED_L3 1
+#endif
+
+// Run the workers as forked processes instead of threads
+#ifndef USE_PROCESSES
+#define USE_PROCESSES 0
+#endif
+
+// Sample per-thread throughput while the benchmark runs
+#ifndef USE_TIMELINE
+#define USE_TIMELINE 0
+#endif
+#ifndef TIMELINE_INTERVAL_US
+#define TIMELINE_INTERVAL_US 10000
+#endif
+
+// Iterations stored per thread and benchmark point in a workload trace;
+// replay cycles through them
+#ifndef TRACE_ITERATIONS
+#define TRACE_ITERATIONS 1024
+#endif
+
 // Mersenne Twister Parameters
 #define MT_N 624
 #define MT_M 397
@@ -55,27 +141,701 @@ unsigned int MersenneTwister::Integer() {
   return y;
 }
 
-static const int kMaxThreads = 4;
+#define LIGHT_ASSERT(x) { if (!(x)) __builtin_trap(); }
+
+class PthreadMutex {
+ public:
+  void Init(bool process_shared) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, process_shared ?
+                                 PTHREAD_PROCESS_SHARED :
+                                 PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&mutex_, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+  void Destroy() {
+    pthread_mutex_destroy(&mutex_);
+  }
+  void Lock() {
+    pthread_mutex_lock(&mutex_);
+  }
+  void Unlock() {
+    pthread_mutex_unlock(&mutex_);
+  }
+
+ private:
+  pthread_mutex_t mutex_;
+};
+
+// No FUTEX_PRIVATE_FLAG: the kernel has to key the futex on the shared
+// page, not on this process' address space.
+int FutexWait(int *addr, int expected, const struct timespec *timeout) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+int FutexWake(int *addr, int count) {
+  return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+// Waits until an absolute CLOCK_MONOTONIC deadline, or forever if NULL
+int FutexWaitUntil(int *addr, int expected, const struct timespec *deadline) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, expected, deadline, NULL,
+                 FUTEX_BITSET_MATCH_ANY);
+}
+
+// Whether deadline, on the CLOCK_MONOTONIC clock, is in the past
+bool DeadlinePassed(const struct timespec &deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > deadline.tv_sec ||
+      (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+__thread int t_tid = 0;
+__thread int t_cpu = -1;
+__thread bool t_robust_list_registered = false;
+__thread struct robust_list_head t_robust_list;
+// Backoff jitter state: a plain thread local, so that getting a generator
+// never allocates in the lock path. 0 means not seeded yet.
+__thread unsigned t_backoff_random = 0;
+
+void ResetThreadCaches() {
+  t_tid = 0;
+  t_cpu = -1;
+  t_backoff_random = 0;
+  t_robust_list_registered = false;
+}
+
+// A forked child starts with its parent's thread locals, so the cached tid
+// and CPU, and the backoff state seeded from the tid, have to be dropped on
+// fork. The kernel does not carry the robust list registration over either.
+struct ThreadCacheReset {
+  ThreadCacheReset() {
+    pthread_atfork(NULL, NULL, ResetThreadCaches);
+  }
+} g_thread_cache_reset;
+
+int CurrentTid() {
+  if (t_tid == 0) {
+    t_tid = syscall(SYS_gettid);
+  }
+  return t_tid;
+}
+
+// Process-shared benaphore, see benaphore_mutex/benaphore_shared.cc. The
+// lock word is a robust futex holding the owner's tid plus FUTEX_WAITERS;
+// every held lock is linked into the owner's robust list, so the kernel
+// marks it FUTEX_OWNER_DIED if the owner dies, and the next Lock() gets
+// EOWNERDEAD.
+class SharedBenaphore {
+ public:
+  void Init(bool process_shared) {
+    node_.next = NULL;
+    word_ = 0;
+  }
+  void Destroy() {
+  }
+  int Lock() {
+    int tid = CurrentTid();
+    SetPendingOp(&node_);
+    int result = 0;
+    if (!__sync_bool_compare_and_swap(&word_, 0, tid)) {
+      result = LockSlow(tid);
+    }
+    node_.next = t_robust_list.list.next;
+    t_robust_list.list.next = &node_;
+    SetPendingOp(NULL);
+    return result;
+  }
+  void Unlock() {
+    int tid = CurrentTid();
+    LIGHT_ASSERT((word_ & FUTEX_TID_MASK) == tid);
+    SetPendingOp(&node_);
+    struct robust_list *prev = &t_robust_list.list;
+    while (prev->next != &node_) {
+      prev = prev->next;
+    }
+    prev->next = node_.next;
+    if (!__sync_bool_compare_and_swap(&word_, tid, 0)) {
+      __atomic_store_n(&word_, 0, __ATOMIC_RELEASE);
+      FutexWake(&word_, 1);
+    }
+    SetPendingOp(NULL);
+  }
+
+ private:
+  // Registers this thread's robust list on first use, and marks node as
+  // being locked or unlocked, see benaphore_shared.cc
+  static void SetPendingOp(struct robust_list *node) {
+    if (!t_robust_list_registered) {
+      t_robust_list.list.next = &t_robust_list.list;
+      t_robust_list.futex_offset =
+          offsetof(SharedBenaphore, word_) - offsetof(SharedBenaphore, node_);
+      t_robust_list.list_op_pending = NULL;
+      LIGHT_ASSERT(syscall(SYS_set_robust_list, &t_robust_list,
+                           sizeof(t_robust_list)) == 0);
+      t_robust_list_registered = true;
+    }
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    t_robust_list.list_op_pending = node;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  }
+
+  int LockSlow(int tid) {
+    for (;;) {
+      int value = __atomic_load_n(&word_, __ATOMIC_RELAXED);
+      if ((value & FUTEX_TID_MASK) == 0) {
+        if (__sync_bool_compare_and_swap(&word_, value, tid | FUTEX_WAITERS)) {
+          return (value & FUTEX_OWNER_DIED) ? EOWNERDEAD : 0;
+        }
+        continue;
+      }
+      if (!(value & FUTEX_WAITERS)) {
+        if (!__sync_bool_compare_and_swap(&word_, value,
+                                          value | FUTEX_WAITERS)) {
+          continue;
+        }
+        value |= FUTEX_WAITERS;
+      }
+      FutexWait(&word_, value, NULL);
+    }
+  }
+
+  // The kernel finds word_ at futex_offset from the list node
+  struct robust_list node_;
+  int word_;
+};
+
+// Workers are pinned, so the CPU seen by the first call stays valid
+int CurrentCpu() {
+  if (t_cpu < 0) {
+    t_cpu = sched_getcpu();
+  }
+  return t_cpu;
+}
+
+// Reads a single integer from a /sys file, or returns fallback
+int ReadSysInt(const char *path, int fallback) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return fallback;
+  }
+  int value;
+  if (fscanf(file, "%d", &value) != 1) {
+    value = fallback;
+  }
+  fclose(file);
+  return value;
+}
+
+// Returns the lowest CPU sharing the given cache level with cpu, or -1 if
+// the kernel does not describe such a cache.
+int CacheDomainOf(int cpu, int level) {
+  char path[128];
+  for (int index = 0; index < 16; ++index) {
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+    int cache_level = ReadSysInt(path, -1);
+    if (cache_level < 0) {
+      break;
+    }
+    if (cache_level == level) {
+      // shared_cpu_list starts with the lowest CPU, e.g. "0-3,8-11"
+      snprintf(path, sizeof(path),
+               "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+               cpu, index);
+      return ReadSysInt(path, -1);
+    }
+  }
+  return -1;
+}
+
+static const int kMaxCpus = CPU_SETSIZE;
+
+// Identifies the L3 domain of cpu, falling back to its physical package
+int L3DomainOf(int cpu) {
+  int id = CacheDomainOf(cpu, 3);
+  if (id < 0) {
+    char path[128];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+             cpu);
+    // Keep package ids apart from CPU numbers
+    id = kMaxCpus + ReadSysInt(path, 0);
+  }
+  return id;
+}
+
+// Numbers the cache/NUMA domains of the CPUs we may run on 0..n-1: CPUs
+// sharing an L3 cache form a domain, falling back to the physical package.
+// Other CPU numbers, most of which do not exist, go in domain 0. Returns n.
+int ReadCpuDomains(int *cpu_domain) {
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+  int domain_ids[kMaxCpus];
+  int domain_count = 0;
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      cpu_domain[cpu] = 0;
+      continue;
+    }
+    int id = L3DomainOf(cpu);
+    int d = 0;
+    while (d < domain_count && domain_ids[d] != id) {
+      d++;
+    }
+    if (d == domain_count) {
+      domain_ids[domain_count++] = id;
+    }
+    cpu_domain[cpu] = d;
+  }
+  return domain_count;
+}
+
+// Unlike the other locks, the sem_t Benaphore may be released by a thread
+// other than the one that acquired it, which the cohort lock relies on.
+class Benaphore {
+ public:
+  void Init(bool process_shared) {
+    counter_ = 0;
+    sem_init(&semaphore_, process_shared, 0);
+  }
+  void Destroy() {
+    sem_destroy(&semaphore_);
+  }
+  void Lock() {
+    if (__sync_add_and_fetch(&counter_, 1) > 1) {
+      sem_wait(&semaphore_);
+    }
+  }
+  void Unlock() {
+    if (__sync_sub_and_fetch(&counter_, 1) > 0) {
+      sem_post(&semaphore_);
+    }
+  }
+
+ private:
+  long counter_;
+  sem_t semaphore_;
+};
+
+// Cohort lock (Dice, Marathe and Shavit): a global Benaphore plus one
+// ticket lock per cache/NUMA domain. The first thread of a domain to get
+// its local lock also takes the global one; on release, if another thread
+// of the same domain holds a ticket, the local lock is passed to it with
+// the global lock still held, so the lock and the data it guards stay in
+// that domain's caches. After COHORT_PASS_BOUND local passes in a row the
+// global lock is released anyway, to keep other domains from starving.
+class CohortLock {
+ public:
+  static const int kMaxDomains = 64;
+  static const int kSpinCount = 100;
+
+  void Init(bool process_shared) {
+    global_.Init(process_shared);
+    if (COHORT_DOMAINS > 0) {
+      domain_count_ = min(COHORT_DOMAINS, static_cast<int>(kMaxDomains));
+      for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+        cpu_domain_[cpu] = cpu % domain_count_;
+      }
+    } else {
+      domain_count_ = min(ReadCpuDomains(cpu_domain_),
+                          static_cast<int>(kMaxDomains));
+      for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+        cpu_domain_[cpu] %= domain_count_;
+      }
+    }
+    for (int d = 0; d < kMaxDomains; ++d) {
+      domains_[d].next_ticket = 0;
+      domains_[d].now_serving = 0;
+      domains_[d].owns_global = false;
+      domains_[d].passes = 0;
+    }
+  }
+  void Destroy() {
+    global_.Destroy();
+  }
+  void Lock() {
+    int cpu = CurrentCpu();
+    int domain = cpu_domain_[cpu >= 0 && cpu < kMaxCpus ? cpu : 0];
+    Domain *local = &domains_[domain];
+    unsigned ticket = __sync_fetch_and_add(&local->next_ticket, 1);
+    for (int spin = 0;
+         __atomic_load_n(&local->now_serving, __ATOMIC_ACQUIRE) != ticket;
+         ++spin) {
+      // Yield once spinning stops paying off, in case the holder is
+      // preempted on our CPU
+      if (spin < kSpinCount) {
+        asm volatile("pause" ::: "memory");
+      } else {
+        sched_yield();
+      }
+    }
+    if (!local->owns_global) {
+      global_.Lock();
+      local->owns_global = true;
+    }
+    holder_domain_ = domain;
+  }
+  void Unlock() {
+    Domain *local = &domains_[holder_domain_];
+    unsigned next = local->now_serving + 1;
+    // Anyone who took a ticket after ours is waiting in this domain
+    if (__atomic_load_n(&local->next_ticket, __ATOMIC_SEQ_CST) != next &&
+        local->passes < COHORT_PASS_BOUND) {
+      local->passes++;
+    } else {
+      local->passes = 0;
+      local->owns_global = false;
+      global_.Unlock();
+    }
+    __atomic_store_n(&local->now_serving, next, __ATOMIC_RELEASE);
+  }
+  int domain_count() const {
+    return domain_count_;
+  }
+
+ private:
+  // Only the holder of the local lock touches owns_global and passes
+  struct Domain {
+    unsigned next_ticket;
+    unsigned now_serving;
+    bool owns_global;
+    int passes;
+  } __attribute__((aligned(64)));
+
+  Benaphore global_;
+  int holder_domain_;
+  int domain_count_;
+  int cpu_domain_[kMaxCpus];
+  Domain domains_[kMaxDomains];
+};
+
+// Backoff policies for SpinLock. A fresh one is made for every contended
+// acquisition, and Wait() is called after each failed attempt.
+struct NoBackoff {
+  void Wait() {
+  }
+};
+
+struct PauseBackoff {
+  void Wait() {
+    asm volatile("pause" ::: "memory");
+  }
+};
+
+// Xorshift generator for backoff jitter, seeded from the tid on first use
+unsigned BackoffRandom() {
+  unsigned x = t_backoff_random;
+  if (x == 0) {
+    x = CurrentTid() * 2654435761u | 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  t_backoff_random = x;
+  return x;
+}
+
+// Bounded exponential backoff. The delay is drawn uniformly from the upper
+// half of the current window so that threads which collided once do not
+// retry in lockstep.
+class ExponentialBackoff {
+ public:
+  static const unsigned kMinDelay = 4;     // In pause instructions
+  static const unsigned kMaxDelay = 4096;
+
+  ExponentialBackoff() : limit_(kMinDelay) {
+  }
+  void Wait() {
+    unsigned delay = limit_ / 2 + BackoffRandom() % (limit_ / 2);
+    for (unsigned i = 0; i < delay; ++i) {
+      asm volatile("pause" ::: "memory");
+    }
+    if (limit_ < kMaxDelay) {
+      limit_ *= 2;
+    }
+  }
+
+ private:
+  unsigned limit_;
+};
+
+// Spins for a while, then gives the CPU away, which is what lets a
+// preempted lock holder run again when there are more threads than cores.
+class YieldBackoff {
+ public:
+  static const int kSpinCount = 100;
+
+  YieldBackoff() : spins_(0) {
+  }
+  void Wait() {
+    if (spins_ < kSpinCount) {
+      spins_++;
+      asm volatile("pause" ::: "memory");
+    } else {
+      sched_yield();
+    }
+  }
+
+ private:
+  int spins_;
+};
+
+// Test-and-test-and-set spinlock: waiters read the lock word until it
+// looks free and only then try the exchange, so the cache line is not
+// bounced between cores by failing atomic writes.
+template <class Backoff>
+class SpinLock {
+ public:
+  void Init(bool process_shared) {
+    locked_ = 0;
+  }
+  void Destroy() {
+  }
+  void Lock() {
+    if (!__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+    Backoff backoff;
+    for (;;) {
+      backoff.Wait();
+      if (!__atomic_load_n(&locked_, __ATOMIC_RELAXED) &&
+          !__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+        return;
+      }
+    }
+  }
+  void Unlock() {
+    __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE);
+  }
+
+ private:
+  int locked_;
+};
+
+// Benaphore whose waiters can give up at a deadline, see
+// benaphore_mutex/benaphore_timed.cc for the withdrawal protocol. Waiters
+// sleep on a token count instead of a sem_t, so that the wait can be timed
+// against an absolute deadline.
+class TimedBenaphore {
+ public:
+  static const int kSpinCount = 100;
+  static const int kDeadlineCheckInterval = 16;  // Spins between clock reads
+
+  void Init(bool process_shared) {
+    counter_ = 0;
+    tokens_ = 0;
+    sleepers_ = 0;
+  }
+  void Destroy() {
+  }
+  void Lock() {
+    if (__sync_add_and_fetch(&counter_, 1) > 1) {
+      WaitForToken(NULL);
+    }
+  }
+  void Unlock() {
+    if (__sync_sub_and_fetch(&counter_, 1) > 0) {
+      __sync_fetch_and_add(&tokens_, 1);
+      if (__atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST) > 0) {
+        FutexWake(&tokens_, 1);
+      }
+    }
+  }
+  bool TryLockUntil(const struct timespec &deadline) {
+    // Spinning does not touch counter_, so giving up here needs no undo,
+    // and once the deadline has passed we give up after a single CAS
+    for (int i = 0; i <= kSpinCount; ++i) {
+      if (__atomic_load_n(&counter_, __ATOMIC_RELAXED) == 0 &&
+          __sync_bool_compare_and_swap(&counter_, 0, 1)) {
+        return true;
+      }
+      if (i % kDeadlineCheckInterval == 0 && DeadlinePassed(deadline)) {
+        return false;
+      }
+      asm volatile("pause" ::: "memory");
+    }
+    if (__sync_add_and_fetch(&counter_, 1) == 1 ||
+        WaitForToken(&deadline)) {
+      return true;
+    }
+    long c = __atomic_load_n(&counter_, __ATOMIC_RELAXED);
+    for (;;) {
+      if (c == 1) {
+        // The last owner is already handing the lock to us
+        WaitForToken(NULL);
+        return true;
+      }
+      if (__atomic_compare_exchange_n(&counter_, &c, c - 1, false,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    if (__atomic_load_n(&tokens_, __ATOMIC_SEQ_CST) > 0 &&
+        __atomic_load_n(&sleepers_, __ATOMIC_SEQ_CST) > 0) {
+      FutexWake(&tokens_, 1);
+    }
+    return false;
+  }
+
+ private:
+  bool TakeToken() {
+    int t = __atomic_load_n(&tokens_, __ATOMIC_RELAXED);
+    while (t > 0) {
+      if (__atomic_compare_exchange_n(&tokens_, &t, t - 1, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  bool WaitForToken(const struct timespec *deadline) {
+    while (!TakeToken()) {
+      __sync_fetch_and_add(&sleepers_, 1);
+      int result = FutexWaitUntil(&tokens_, 0, deadline);
+      __sync_fetch_and_sub(&sleepers_, 1);
+      if (result == -1 && errno == ETIMEDOUT) {
+        return TakeToken();
+      }
+    }
+    return true;
+  }
+
+  long counter_;
+  int tokens_;
+  int sleepers_;
+};
+
+#if USE_LOCK == LOCK_SHARED_BENAPHORE
+typedef SharedBenaphore BenchmarkLock;
+static const char kLockName[] = "shared_benaphore";
+#elif USE_LOCK == LOCK_COHORT
+typedef CohortLock BenchmarkLock;
+static const char kLockName[] = "cohort";
+#elif USE_LOCK == LOCK_SPIN
+typedef SpinLock<NoBackoff> BenchmarkLock;
+static const char kLockName[] = "spin";
+#elif USE_LOCK == LOCK_SPIN_PAUSE
+typedef SpinLock<PauseBackoff> BenchmarkLock;
+static const char kLockName[] = "spin_pause";
+#elif USE_LOCK == LOCK_SPIN_EXPONENTIAL
+typedef SpinLock<ExponentialBackoff> BenchmarkLock;
+static const char kLockName[] = "spin_exponential";
+#elif USE_LOCK == LOCK_SPIN_YIELD
+typedef SpinLock<YieldBackoff> BenchmarkLock;
+static const char kLockName[] = "spin_yield";
+#elif USE_LOCK == LOCK_TIMED_BENAPHORE
+typedef TimedBenaphore BenchmarkLock;
+static const char kLockName[] = "timed_benaphore";
+#else
+typedef PthreadMutex BenchmarkLock;
+static const char kLockName[] = "pthread_mutex";
+#endif
+
+static const int kMaxThreads = 16;
 
 struct ThreadStats {
   uint64_t workdone;
   uint64_t iterations;
   uint64_t overshoot;
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  uint64_t timeouts;  // Critical sections skipped at the deadline
+#endif
+};
+
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+// Time from the start of an acquisition to taking the lock or giving up,
+// in a log-scale histogram of four buckets per power of two, as in
+// benaphore_mutex/benaphore_handoff.cc.
+static const int kHistogramBuckets = 4 * 40;
+
+struct AcquireHistogram {
+  uint64_t buckets[kHistogramBuckets];
 };
 
+int HistogramBucket(float ns) {
+  if (ns < 1) {
+    return 0;
+  }
+  int exponent;
+  float mantissa = frexpf(ns, &exponent);  // ns = mantissa * 2^exponent
+  int bucket = exponent * 4 + static_cast<int>((mantissa - 0.5f) * 8);
+  return bucket < kHistogramBuckets ? bucket : kHistogramBuckets - 1;
+}
+
+float HistogramPercentile(const AcquireHistogram &histogram,
+                          float percentile) {
+  uint64_t total = 0;
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    total += histogram.buckets[i];
+  }
+  uint64_t rank = static_cast<uint64_t>(total * percentile);
+  uint64_t seen = 0;
+  for (int i = 0; i < kHistogramBuckets; ++i) {
+    seen += histogram.buckets[i];
+    if (seen > rank) {
+      // Upper bound of the bucket
+      return ldexpf(0.5f + (i % 4 + 1) / 8.0f, i / 4);
+    }
+  }
+  return 0;
+}
+#endif
+
+// Counters a worker publishes while it runs. Each thread owns a whole cache
+// line, so the monitor reading them never false-shares with another worker.
+struct LiveCounters {
+  uint64_t workdone;
+  uint64_t iterations;
+} __attribute__((aligned(64)));
+
 struct GlobalState {
-  pthread_mutex_t thread_mutex;
+  BenchmarkLock thread_mutex;
   int count;
   pthread_mutex_t count_mutex;
   pthread_cond_t count_cond;
-  float secs_per_work_unit;
   float time_limit;
-  float average_unlock_count;
-  float average_locked_count;
+  int thread_cpu[kMaxThreads];
+  // Per thread, since each thread's CPU is calibrated on its own
+  float secs_per_work_unit[kMaxThreads];
+  float average_unlock_count[kMaxThreads];
+  float average_locked_count[kMaxThreads];
   ThreadStats thread_stats[kMaxThreads];
+  LiveCounters live_counters[kMaxThreads];
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  AcquireHistogram acquire_histograms[kMaxThreads];
+#endif
 };
 
-GlobalState global_state = {0};
+#if USE_PROCESSES
+// The workers are forked, so everything they share has to live in a
+// MAP_SHARED mapping. The name is unlinked as soon as it is mapped; the
+// children inherit the mapping itself.
+GlobalState *MapGlobalState() {
+  char name[64];
+  snprintf(name, sizeof(name), "/lock_benchmark.%d", getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 || ftruncate(fd, sizeof(GlobalState)) < 0) {
+    perror("shm_open");
+    exit(1);
+  }
+  void *addr = mmap(NULL, sizeof(GlobalState), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  shm_unlink(name);
+  if (addr == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return static_cast<GlobalState *>(addr);
+}
+
+GlobalState &global_state = *MapGlobalState();
+#else
+GlobalState global_state;
+#endif
 
 struct BenchmarkParams {
   int thread_count;
@@ -102,6 +862,13 @@ BenchmarkParams g_benchmark_params[] = {
     2, 10e-6f,      // 10 us        100000/s
     2, 31.6e-6f,    // 31.6 us      31600/s
     2, 100e-6f,     // 100 us       10000/s
+
+    // Oversubscribe a 4-core machine: spinning waiters now steal CPU time
+    // from a preempted lock holder
+    8, 1/15000.0f,
+    16, 1/15000.0f,
+    8, 1e-6f,
+    16, 1e-6f,
 };
 
 void GetMonotonicTime(struct timespec *ts) {
@@ -114,154 +881,1570 @@ float GetElapsedTime(struct timespec *before, struct timespec *after) {
   return delta_s + delta_ns * 1e-9;
 }
 
-void* ThreadProc(void *arg) {
-  // Initialize
-  int thread_number = *(static_cast<int*>(arg));
-  MersenneTwister random(thread_number);
-  struct timespec start, end;
-  float elapsed_time = 0;
-  ThreadStats thread_stats = {0};
-  int work_units = 0;
+static const int kBenchmarkPoints =
+    sizeof(g_benchmark_params) / sizeof(g_benchmark_params[0]);
+static const int kSteps = BENCHMARK_STEPS;
+static const int kRepetitions = BENCHMARK_REPETITIONS;
+// A run is one repetition of one step of one benchmark point
+static const int kRuns = kBenchmarkPoints * kSteps * kRepetitions;
 
-  // Indicate ready, wait for start
-  pthread_mutex_lock(&global_state.count_mutex);
-  global_state.count++;
-  pthread_cond_broadcast(&global_state.count_cond);
-  pthread_mutex_unlock(&global_state.count_mutex);
+int RunPoint(int run) {
+  return run / (kSteps * kRepetitions);
+}
 
-  pthread_mutex_lock(&global_state.count_mutex);
-  while (global_state.count != 0) {
-    pthread_cond_wait(&global_state.count_cond,
-                      &global_state.count_mutex);
-  }
-  pthread_mutex_unlock(&global_state.count_mutex);
-  GetMonotonicTime(&start);
-  for (;;) {
-    work_units = static_cast<int> (random.PoissonInterval(
-        global_state.average_unlock_count) + 0.5f);
-    for (int i = 0; i < work_units; ++i) {
-      random.Integer();
-    }
-    thread_stats.workdone += work_units;
+int RunStep(int run) {
+  return run / kRepetitions % kSteps;
+}
 
-    GetMonotonicTime(&end);
-    elapsed_time = GetElapsedTime(&start, &end);
-    if (elapsed_time >= global_state.time_limit) {
-      break;
-    }
+int RunRepetition(int run) {
+  return run % kRepetitions;
+}
 
-    // Do some work while holding the lock
-    pthread_mutex_lock(&global_state.thread_mutex);
-    work_units = static_cast<int> (random.PoissonInterval(
-        global_state.average_locked_count) + 0.5f);
-    for (int i = 0; i < work_units; ++i) {
-      random.Integer();
-    }
-    thread_stats.workdone += work_units;
-    pthread_mutex_unlock(&global_state.thread_mutex);
+// Where the results go, and where everything else goes: with csv or json
+// output, stdout carries nothing but the results.
+enum OutputFormat {
+  kFormatText,
+  kFormatCsv,
+  kFormatJson,
+};
 
-    thread_stats.iterations++;
-    GetMonotonicTime(&end);
-    elapsed_time = GetElapsedTime(&start, &end);
-    if (elapsed_time >= global_state.time_limit) {
-      break;
-    }
-  }
+OutputFormat g_format = kFormatText;
+FILE *g_info = stdout;
 
-  // Estimate the number of work units which went over the time limit
-  thread_stats.overshoot = min(work_units,
-                               static_cast<int>
-                               ((elapsed_time -global_state.time_limit) /
-                                     global_state.secs_per_work_unit));
-  global_state.thread_stats[thread_number] = thread_stats;
-  return NULL;
+// Average number of work units thread t does outside and inside the lock at
+// step s of benchmark point b
+void PointWorkload(int b, int s, int t, float *unlocked, float *locked) {
+  float avg_work_units_between_locks = g_benchmark_params[b].lock_interval /
+      global_state.secs_per_work_unit[t];
+  *locked = avg_work_units_between_locks * s / kSteps;
+  *unlocked = avg_work_units_between_locks * (kSteps - s) / kSteps;
 }
 
+// Workload trace file: a TraceHeader, one TracePoint per benchmark point,
+// a TraceSequence for every (point, step, thread) and then the sequences
+// themselves. A sequence is TRACE_ITERATIONS pairs of (unlocked, locked)
+// work unit counts, each count a LEB128 varint.
+static const char kTraceMagic[8] = { 'L', 'B', 'T', 'R', 'A', 'C', 'E', '1' };
 
-float CalcSecsPerWorkUnit() {
-  MersenneTwister random(1234);
+struct TraceHeader {
+  char magic[8];
+  int point_count;
+  int steps;
+  int max_threads;
+  int iterations;
+};
+
+struct TracePoint {
+  int thread_count;
+  float lock_interval;
+};
+
+struct TraceSequence {
+  uint64_t begin;  // File offsets
+  uint64_t end;
+};
+
+struct Trace {
+  const unsigned char *data;
+  size_t size;
+  const TraceSequence *sequences;
+};
+
+Trace g_trace;
+
+// The sequence each worker replays at the current point, set by main
+// before the workers start
+const unsigned char *g_replay_begin[kMaxThreads];
+const unsigned char *g_replay_end[kMaxThreads];
+
+int TraceSequenceIndex(int b, int s, int t) {
+  return (b * kSteps + s) * kMaxThreads + t;
+}
+
+int PutVarint(unsigned int value, unsigned char *out) {
+  int n = 0;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+// Reads varints straight out of the mapped file, starting over at the end
+// of the sequence. Only end_ is checked before a varint is decoded, which
+// is safe because MapTrace rejects sequences whose last byte continues.
+// A corrupt varint longer than kMaxVarintBytes is cut there, and the rest
+// of it is read as the next value.
+class TraceCursor {
+ public:
+  // An unsigned int takes at most 5 bytes, the last at shift 28
+  static const int kMaxVarintBytes = 5;
+
+  TraceCursor(const unsigned char *begin, const unsigned char *end)
+      : begin_(begin), end_(end), next_(begin) {
+  }
+  int Next() {
+    if (next_ == end_) {
+      next_ = begin_;
+    }
+    unsigned int value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+      byte = *next_++;
+      value |= static_cast<unsigned int>(byte & 0x7f) << shift;
+      shift += 7;
+    } while ((byte & 0x80) && shift < 7 * kMaxVarintBytes);
+    return value;
+  }
+
+ private:
+  const unsigned char *begin_;
+  const unsigned char *end_;
+  const unsigned char *next_;
+};
+
+// Draws every sequence the benchmark will need, with the same Poisson
+// distribution ThreadProc uses live, and writes them to path. The counts
+// depend on this machine's calibration; replaying them elsewhere keeps the
+// work unit counts, not the lock interval in seconds.
+bool RecordTrace(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  TraceHeader header;
+  memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+  header.point_count = kBenchmarkPoints;
+  header.steps = kSteps;
+  header.max_threads = kMaxThreads;
+  header.iterations = TRACE_ITERATIONS;
+  TracePoint points[kBenchmarkPoints];
+  for (int b = 0; b < kBenchmarkPoints; ++b) {
+    points[b].thread_count = g_benchmark_params[b].thread_count;
+    points[b].lock_interval = g_benchmark_params[b].lock_interval;
+  }
+  int sequence_count = kBenchmarkPoints * kSteps * kMaxThreads;
+  TraceSequence *sequences = new TraceSequence[sequence_count];
+  memset(sequences, 0, sizeof(TraceSequence) * sequence_count);
+  uint64_t offset = sizeof(header) + sizeof(points) +
+      sizeof(TraceSequence) * sequence_count;
+  fseek(file, offset, SEEK_SET);
+
+  // Five bytes hold any 32-bit varint
+  unsigned char *buffer = new unsigned char[TRACE_ITERATIONS * 2 * 5];
+  for (int b = 0; b < kBenchmarkPoints; ++b) {
+    for (int s = 0; s < kSteps; ++s) {
+      for (int t = 0; t < g_benchmark_params[b].thread_count; ++t) {
+        MersenneTwister random(t);
+        float unlocked, locked;
+        PointWorkload(b, s, t, &unlocked, &locked);
+        int size = 0;
+        for (int i = 0; i < TRACE_ITERATIONS; ++i) {
+          size += PutVarint(static_cast<unsigned int>(
+              random.PoissonInterval(unlocked) + 0.5f), buffer + size);
+          size += PutVarint(static_cast<unsigned int>(
+              random.PoissonInterval(locked) + 0.5f), buffer + size);
+        }
+        fwrite(buffer, 1, size, file);
+        TraceSequence *sequence = &sequences[TraceSequenceIndex(b, s, t)];
+        sequence->begin = offset;
+        sequence->end = offset + size;
+        offset += size;
+      }
+    }
+  }
+  delete[] buffer;
+
+  rewind(file);
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(points, sizeof(points), 1, file);
+  fwrite(sequences, sizeof(TraceSequence), sequence_count, file);
+  delete[] sequences;
+  if (ferror(file) | fclose(file)) {
+    perror(path);
+    return false;
+  }
+  fprintf(g_info, "trace = %s, %llu bytes recorded\n", path, offset);
+  return true;
+}
+
+// Maps a trace read-only. It has to have been recorded for the same
+// benchmark points, steps and thread limit as this binary was built with.
+bool MapTrace(const char *path, Trace *trace) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return false;
+  }
+  void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  trace->data = static_cast<const unsigned char*>(addr);
+  trace->size = st.st_size;
+
+  const TraceHeader *header = static_cast<const TraceHeader*>(addr);
+  const TracePoint *points = reinterpret_cast<const TracePoint*>(header + 1);
+  trace->sequences = reinterpret_cast<const TraceSequence*>(
+      points + kBenchmarkPoints);
+  size_t tables_end = static_cast<size_t>(
+      reinterpret_cast<const unsigned char*>(
+          trace->sequences + kBenchmarkPoints * kSteps * kMaxThreads) -
+      trace->data);
+  bool valid = trace->size >= sizeof(TraceHeader) &&
+      memcmp(header->magic, kTraceMagic, sizeof(kTraceMagic)) == 0 &&
+      header->point_count == kBenchmarkPoints &&
+      header->steps == kSteps &&
+      header->max_threads == kMaxThreads &&
+      header->iterations > 0 &&
+      trace->size >= tables_end;
+  for (int b = 0; valid && b < kBenchmarkPoints; ++b) {
+    valid = points[b].thread_count == g_benchmark_params[b].thread_count &&
+        points[b].lock_interval == g_benchmark_params[b].lock_interval;
+    for (int s = 0; valid && s < kSteps; ++s) {
+      for (int t = 0; valid && t < points[b].thread_count; ++t) {
+        const TraceSequence *sequence =
+            &trace->sequences[TraceSequenceIndex(b, s, t)];
+        // A sequence must end with the last byte of a varint, or
+        // TraceCursor would decode past it
+        valid = sequence->begin >= static_cast<uint64_t>(tables_end) &&
+            sequence->begin < sequence->end &&
+            sequence->end <= static_cast<uint64_t>(trace->size) &&
+            !(trace->data[sequence->end - 1] & 0x80);
+      }
+    }
+  }
+  if (!valid) {
+    fprintf(stderr, "error: %s does not match this benchmark\n", path);
+    munmap(addr, st.st_size);
+    return false;
+  }
+  madvise(addr, st.st_size, MADV_WILLNEED);
+  return true;
+}
+
+#if USE_TIMELINE
+static const int kMaxTimelineSamples = 4096;
+
+struct TimelineSample {
+  float time;
+  uint64_t workdone[kMaxThreads];
+  uint64_t iterations[kMaxThreads];
+};
+
+struct Timeline {
+  int thread_count;
+  int sample_count;
+  bool done;
+  float sample_cost;  // Seconds spent reading the counters
+  float monitor_cpu;  // CPU seconds used by the monitor thread
+  float elapsed_time;
+  TimelineSample samples[kMaxTimelineSamples];
+};
+
+Timeline g_timeline;
+
+void TakeTimelineSample(struct timespec *start) {
+  struct timespec now, end;
+  GetMonotonicTime(&now);
+  TimelineSample *sample = &g_timeline.samples[g_timeline.sample_count++];
+  sample->time = GetElapsedTime(start, &now);
+  for (int t = 0; t < g_timeline.thread_count; ++t) {
+    LiveCounters *live = &global_state.live_counters[t];
+    sample->workdone[t] = __atomic_load_n(&live->workdone, __ATOMIC_RELAXED);
+    sample->iterations[t] = __atomic_load_n(&live->iterations,
+                                            __ATOMIC_RELAXED);
+  }
+  GetMonotonicTime(&end);
+  g_timeline.sample_cost += GetElapsedTime(&now, &end);
+}
+
+// Wakes up every TIMELINE_INTERVAL_US on an absolute schedule, so a late
+// sample does not shift the ones after it.
+void* MonitorProc(void *arg) {
+  struct timespec start, next, end, cpu_start, cpu_end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+  GetMonotonicTime(&start);
+  next = start;
+  TakeTimelineSample(&start);
+  while (!__atomic_load_n(&g_timeline.done, __ATOMIC_ACQUIRE) &&
+         g_timeline.sample_count < kMaxTimelineSamples) {
+    next.tv_nsec += TIMELINE_INTERVAL_US * 1000L;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    TakeTimelineSample(&start);
+  }
+  GetMonotonicTime(&end);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+  g_timeline.elapsed_time = GetElapsedTime(&start, &end);
+  g_timeline.monitor_cpu = GetElapsedTime(&cpu_start, &cpu_end);
+  return NULL;
+}
+
+void ReportTimeline() {
+  for (int i = 1; i < g_timeline.sample_count; ++i) {
+    TimelineSample *prev = &g_timeline.samples[i - 1];
+    TimelineSample *sample = &g_timeline.samples[i];
+    float interval = sample->time - prev->time;
+    for (int t = 0; t < g_timeline.thread_count; ++t) {
+      fprintf(g_info, "timeline time=%f thread=%d ", sample->time, t);
+      fprintf(g_info, "workRate=%e ",
+              (sample->workdone[t] - prev->workdone[t]) / interval);
+      fprintf(g_info, "iterationRate=%e \n",
+              (sample->iterations[t] - prev->iterations[t]) / interval);
+    }
+  }
+  fprintf(g_info, "timelineOverhead samples=%d ", g_timeline.sample_count);
+  fprintf(g_info, "sampleCost=%e ", g_timeline.sample_cost /
+          g_timeline.sample_count);
+  fprintf(g_info, "monitorLoad=%f \n", g_timeline.monitor_cpu /
+          g_timeline.elapsed_time);
+}
+#endif
+
+void* ThreadProc(void *arg) {
+  // Initialize
+  int thread_number = *(static_cast<int*>(arg));
+  MersenneTwister random(thread_number);
   struct timespec start, end;
-  int count = 100000000;
+  float elapsed_time = 0;
+  ThreadStats thread_stats = {0};
+  // Replaying a trace takes the Poisson draws out of the timed loop
+  bool replay = g_trace.data != NULL;
+  TraceCursor trace(g_replay_begin[thread_number],
+                    g_replay_end[thread_number]);
+#if USE_TIMELINE
+  LiveCounters *live = &global_state.live_counters[thread_number];
+#endif
+  int work_units = 0;
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  AcquireHistogram acquire_histogram = {{0}};
+#endif
+
+  // Indicate ready, wait for start
+  pthread_mutex_lock(&global_state.count_mutex);
+  global_state.count++;
+  pthread_cond_broadcast(&global_state.count_cond);
+  pthread_mutex_unlock(&global_state.count_mutex);
+
+  pthread_mutex_lock(&global_state.count_mutex);
+  while (global_state.count != 0) {
+    pthread_cond_wait(&global_state.count_cond,
+                      &global_state.count_mutex);
+  }
+  pthread_mutex_unlock(&global_state.count_mutex);
   GetMonotonicTime(&start);
-  for (int i = 0; i < count; ++i) {
+  for (;;) {
+    work_units = replay ? trace.Next() :
+        static_cast<int> (random.PoissonInterval(
+            global_state.average_unlock_count[thread_number]) + 0.5f);
+    for (int i = 0; i < work_units; ++i) {
+      random.Integer();
+    }
+    thread_stats.workdone += work_units;
+#if USE_TIMELINE
+    // Single writer, so a relaxed store is enough: a plain mov on x86
+    __atomic_store_n(&live->workdone, thread_stats.workdone,
+                     __ATOMIC_RELAXED);
+#endif
+
+    GetMonotonicTime(&end);
+    elapsed_time = GetElapsedTime(&start, &end);
+    if (elapsed_time >= global_state.time_limit) {
+      break;
+    }
+
+    // Do some work while holding the lock
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+    struct timespec deadline = end;
+    deadline.tv_nsec += TIMED_LOCK_DEADLINE_US * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+    }
+    bool locked = global_state.thread_mutex.TryLockUntil(deadline);
+    struct timespec acquired;
+    GetMonotonicTime(&acquired);
+    acquire_histogram.buckets[HistogramBucket(
+        GetElapsedTime(&end, &acquired) * 1e9f)]++;
+#else
+    global_state.thread_mutex.Lock();
+#endif
+    work_units = replay ? trace.Next() :
+        static_cast<int> (random.PoissonInterval(
+            global_state.average_locked_count[thread_number]) + 0.5f);
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+    // Shed the critical section, but keep the workload draws in step
+    if (!locked) {
+      thread_stats.timeouts++;
+      work_units = 0;
+      GetMonotonicTime(&end);
+      elapsed_time = GetElapsedTime(&start, &end);
+      if (elapsed_time >= global_state.time_limit) {
+        break;
+      }
+      continue;
+    }
+#endif
+    for (int i = 0; i < work_units; ++i) {
+      random.Integer();
+    }
+    thread_stats.workdone += work_units;
+    global_state.thread_mutex.Unlock();
+
+    thread_stats.iterations++;
+#if USE_TIMELINE
+    __atomic_store_n(&live->workdone, thread_stats.workdone,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&live->iterations, thread_stats.iterations,
+                     __ATOMIC_RELAXED);
+#endif
+    GetMonotonicTime(&end);
+    elapsed_time = GetElapsedTime(&start, &end);
+    if (elapsed_time >= global_state.time_limit) {
+      break;
+    }
+  }
+
+  // Estimate the number of work units which went over the time limit
+  thread_stats.overshoot = min(work_units,
+                               static_cast<int>
+                               ((elapsed_time -global_state.time_limit) /
+                                     global_state.secs_per_work_unit[
+                                         thread_number]));
+  global_state.thread_stats[thread_number] = thread_stats;
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  global_state.acquire_histograms[thread_number] = acquire_histogram;
+#endif
+  return NULL;
+}
+
+
+// Mutual-exclusion stress test of BenchmarkLock, as in
+// benaphore_mutex/benaphore_recur_test.cc. Thread t claims to run on CPU t,
+// so with emulated cohort domains the threads alternate between domains
+// whichever CPUs they actually get.
+static const int kStressThreads = 4;
+static const int kStressIterations = 500000;
+
+int g_inside = 0;
+uint64_t g_stress_counter = 0;
+
+void* StressProc(void *arg) {
+  int thread_number = *(static_cast<int*>(arg));
+  t_cpu = thread_number;
+  MersenneTwister random(thread_number);
+  for (int i = 0; i < kStressIterations; ++i) {
+    global_state.thread_mutex.Lock();
+    LIGHT_ASSERT(++g_inside == 1);
+    int work_units = random.Integer() % 32;
+    for (int j = 0; j < work_units; ++j) {
+      random.Integer();
+    }
+    g_stress_counter++;
+    LIGHT_ASSERT(--g_inside == 0);
+    global_state.thread_mutex.Unlock();
+    work_units = random.Integer() % 64;
+    for (int j = 0; j < work_units; ++j) {
+      random.Integer();
+    }
+  }
+  return NULL;
+}
+
+// Returns false if the threads could not be started
+bool RunStressTest() {
+  pthread_t threads[kStressThreads];
+  int thread_ids[kStressThreads];
+  for (int t = 0; t < kStressThreads; ++t) {
+    thread_ids[t] = t;
+    int rc;
+    if ((rc = pthread_create(&threads[t], NULL, StressProc, &thread_ids[t]))) {
+      fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+      return false;
+    }
+  }
+  for (int t = 0; t < kStressThreads; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+  LIGHT_ASSERT(g_stress_counter ==
+               static_cast<uint64_t>(kStressThreads) * kStressIterations);
+  printf("stress lock=%s threads=%d iterations=%llu ok\n", kLockName,
+         kStressThreads, g_stress_counter);
+  return true;
+}
+
+
+static const int kCalibrationBatch = 50000;
+static const int kCalibrationMinBatches = 16;
+static const int kCalibrationMaxBatches = 200;
+static const float kCalibrationTolerance = 0.01f;
+
+struct Calibration {
+  int cpu;
+  float secs_per_work_unit;
+  int batches;
+};
+
+// Times batches of work units on the current CPU until the standard error
+// of the mean batch time is within kCalibrationTolerance of the mean, which
+// on an idle core takes a few milliseconds. A core that never settles gives
+// up after kCalibrationMaxBatches, 10M work units.
+void CalibrateCpu(Calibration *calibration) {
+  MersenneTwister random(1234);
+  struct timespec start, end;
+  double mean = 0;
+  double m2 = 0;
+  int n = 0;
+  // Warm up caches and the branch predictor first
+  for (int i = 0; i < kCalibrationBatch; ++i) {
     random.Integer();
   }
-  GetMonotonicTime(&end);
-  float elapsed_time = GetElapsedTime(&start, &end);
-  return elapsed_time / count;
+  while (n < kCalibrationMaxBatches) {
+    GetMonotonicTime(&start);
+    for (int i = 0; i < kCalibrationBatch; ++i) {
+      random.Integer();
+    }
+    GetMonotonicTime(&end);
+    // Welford's running mean and variance
+    double x = GetElapsedTime(&start, &end) / kCalibrationBatch;
+    double delta = x - mean;
+    mean += delta / ++n;
+    m2 += delta * (x - mean);
+    if (n >= kCalibrationMinBatches &&
+        sqrt(m2 / (n - 1) / n) < kCalibrationTolerance * mean) {
+      break;
+    }
+  }
+  calibration->secs_per_work_unit = mean;
+  calibration->batches = n;
 }
 
-int main(int argc, char *argv[]) {
-  pthread_mutex_init(&global_state.thread_mutex, NULL);
-  pthread_mutex_init(&global_state.count_mutex, NULL);
+// The CPUs of one L2 group, calibrated by one thread
+struct CalibrationGroup {
+  int count;
+  Calibration *calibrations;
+  pthread_t thread;
+};
+
+// Calibrates the CPUs of a group one after another, pinned to each in
+// turn, since SMT siblings would slow each other down.
+void* CalibrationGroupProc(void *arg) {
+  CalibrationGroup *group = static_cast<CalibrationGroup*>(arg);
+  for (int i = 0; i < group->count; ++i) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(group->calibrations[i].cpu, &cpus);
+    // If the CPU is not available, measure wherever we are
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    CalibrateCpu(&group->calibrations[i]);
+  }
+  return NULL;
+}
+
+void ReadCpuModel(char *model, int size) {
+  char line[256];
+  snprintf(model, size, "unknown");
+  FILE *file = fopen("/proc/cpuinfo", "r");
+  if (file == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "model name", 10) == 0 && strchr(line, ':') != NULL) {
+      const char *value = strchr(line, ':') + 1;
+      while (*value == ' ' || *value == '\t') {
+        value++;
+      }
+      snprintf(model, size, "%.*s", static_cast<int>(strcspn(value, "\n")),
+               value);
+      break;
+    }
+  }
+  fclose(file);
+}
+
+// Work units only keep their meaning for the same CPU model, frequency
+// governor and compiled code, so those make up the cache key.
+void CalibrationKey(int cpu, char *key, int size) {
+  char model[128];
+  char governor[64] = "none";
+  char line[256];
+  ReadCpuModel(model, sizeof(model));
+  snprintf(line, sizeof(line),
+           "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+  FILE *file = fopen(line, "r");
+  if (file != NULL) {
+    if (fscanf(file, "%63s", governor) != 1) {
+      strcpy(governor, "none");
+    }
+    fclose(file);
+  }
+  snprintf(key, size, "%s|%s|gcc %s", model, governor, __VERSION__);
+}
+
+static const int kMaxCalibrationEntries = 256;
+static const int kCalibrationKeySize = 256;
+
+struct CalibrationEntry {
+  int cpu;
+  float secs_per_work_unit;
+  char key[kCalibrationKeySize];
+};
+
+// Cached calibrations, one "cpu secsPerWorkUnit key" line per CPU.
+struct CalibrationCache {
+  char path[512];
+  int count;
+  CalibrationEntry entries[kMaxCalibrationEntries];
+};
+
+void LoadCalibrationCache(CalibrationCache *cache) {
+  const char *home = getenv("HOME");
+  if (home != NULL) {
+    snprintf(cache->path, sizeof(cache->path), "%s/.cache", home);
+    mkdir(cache->path, 0755);
+    strncat(cache->path, "/lock_benchmark_calibration",
+            sizeof(cache->path) - strlen(cache->path) - 1);
+  } else {
+    snprintf(cache->path, sizeof(cache->path),
+             "lock_benchmark_calibration");
+  }
+  cache->count = 0;
+  FILE *file = fopen(cache->path, "r");
+  if (file == NULL) {
+    return;
+  }
+  CalibrationEntry *entry = &cache->entries[0];
+  while (cache->count < kMaxCalibrationEntries &&
+         fscanf(file, "%d %e %255[^\n]", &entry->cpu,
+                &entry->secs_per_work_unit, entry->key) == 3) {
+    entry = &cache->entries[++cache->count];
+  }
+  fclose(file);
+}
+
+void SaveCalibrationCache(CalibrationCache *cache) {
+  char tmp_path[sizeof(cache->path) + 16];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache->path, getpid());
+  FILE *file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    return;
+  }
+  for (int i = 0; i < cache->count; ++i) {
+    fprintf(file, "%d %e %s\n", cache->entries[i].cpu,
+            cache->entries[i].secs_per_work_unit, cache->entries[i].key);
+  }
+  fclose(file);
+  rename(tmp_path, cache->path);
+}
+
+// Looks up the cached calibration of cpu. Returns whether there was one
+// for the current key.
+bool LookupCalibration(CalibrationCache *cache, int cpu,
+                       float *secs_per_work_unit) {
+  char key[kCalibrationKeySize];
+  CalibrationKey(cpu, key, sizeof(key));
+  for (int i = 0; i < cache->count; ++i) {
+    if (cache->entries[i].cpu == cpu) {
+      if (strcmp(cache->entries[i].key, key) != 0) {
+        return false;
+      }
+      *secs_per_work_unit = cache->entries[i].secs_per_work_unit;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Replaces the cached calibration of cpu, or adds it if there is room
+void StoreCalibration(CalibrationCache *cache, int cpu,
+                      float secs_per_work_unit) {
+  int i = 0;
+  while (i < cache->count && cache->entries[i].cpu != cpu) {
+    i++;
+  }
+  if (i == cache->count) {
+    if (cache->count == kMaxCalibrationEntries) {
+      return;
+    }
+    cache->count++;
+  }
+  cache->entries[i].cpu = cpu;
+  cache->entries[i].secs_per_work_unit = secs_per_work_unit;
+  CalibrationKey(cpu, cache->entries[i].key, sizeof(cache->entries[i].key));
+}
+
+#if USE_PROCESSES
+typedef pid_t Worker;
+#else
+typedef pthread_t Worker;
+#endif
+
+// Starts a worker pinned to its CPU, as a thread or as a forked process.
+// Returns 0 or an error number.
+int StartWorker(Worker *worker, int *thread_number) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(global_state.thread_cpu[*thread_number], &cpus);
+#if USE_PROCESSES
+  pid_t pid = fork();
+  if (pid == 0) {
+    sched_setaffinity(0, sizeof(cpu_set_t), &cpus);
+    ThreadProc(thread_number);
+    _exit(0);
+  }
+  if (pid < 0) {
+    return errno;
+  }
+  *worker = pid;
+#else
+  int rc;
+  if ((rc = pthread_create(worker, NULL, ThreadProc, thread_number))) {
+    return rc;
+  }
+  pthread_setaffinity_np(*worker, sizeof(cpu_set_t), &cpus);
+#endif
+  return 0;
+}
+
+void JoinWorker(Worker worker) {
+#if USE_PROCESSES
+  waitpid(worker, NULL, 0);
+#else
+  pthread_join(worker, NULL);
+#endif
+}
+
+void InitGlobalState() {
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t cond_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_condattr_init(&cond_attr);
+  if (USE_PROCESSES) {
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  }
+  global_state.thread_mutex.Init(USE_PROCESSES);
+  pthread_mutex_init(&global_state.count_mutex, &mutex_attr);
   global_state.count = 0;
-  pthread_cond_init(&global_state.count_cond, NULL);
-  global_state.time_limit = 1.0f;
-  global_state.secs_per_work_unit = CalcSecsPerWorkUnit();
-  printf("secsPerWorkUnit = %e\n", global_state.secs_per_work_unit);
-  for (int b = 0; b <
-           sizeof(g_benchmark_params) / sizeof(g_benchmark_params[0]); ++b) {
-    float avg_work_units_between_locks = g_benchmark_params[b].lock_interval /
-        global_state.secs_per_work_unit;
-    int thread_count = g_benchmark_params[b].thread_count;
-    static const int kSteps = 200;
-    for (int s = 0; s < kSteps; ++s) {
-      global_state.count = 0;
-      global_state.average_locked_count = avg_work_units_between_locks *
-          s / kSteps;
-      global_state.average_unlock_count = avg_work_units_between_locks *
-          (kSteps - s) / kSteps;
-      pthread_t threads[kMaxThreads];
-      int thread_ids[kMaxThreads];
-      for (int t = 0; t < thread_count; ++t) {
-        thread_ids[t] = t;
-        int rc;
-        if ((rc = pthread_create(&threads[t], NULL,
-                                 ThreadProc, &thread_ids[t]))) {
-          fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
-          return -1;
+  pthread_cond_init(&global_state.count_cond, &cond_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  pthread_condattr_destroy(&cond_attr);
+  global_state.time_limit = BENCHMARK_TIME_LIMIT;
+}
+
+void DestroyGlobalState() {
+  global_state.thread_mutex.Destroy();
+  pthread_mutex_destroy(&global_state.count_mutex);
+  pthread_cond_destroy(&global_state.count_cond);
+}
+
+struct PointResult {
+  ThreadStats totals;
+  ThreadStats thread_stats[kMaxThreads];
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  // Acquisition latency over all threads, timeouts included
+  float acquire_p50_ns;
+  float acquire_p99_ns;
+  float acquire_p999_ns;
+#endif
+  int partition;
+  int done;
+};
+
+// Runs step s of benchmark point b on the CPUs in global_state.thread_cpu.
+// Returns false if the workers could not be started.
+bool RunBenchmarkPoint(int b, int s, PointResult *result) {
+  int thread_count = g_benchmark_params[b].thread_count;
+  global_state.count = 0;
+  for (int t = 0; t < thread_count; ++t) {
+    global_state.live_counters[t].workdone = 0;
+    global_state.live_counters[t].iterations = 0;
+  }
+  for (int t = 0; t < thread_count; ++t) {
+    PointWorkload(b, s, t, &global_state.average_unlock_count[t],
+                  &global_state.average_locked_count[t]);
+    if (g_trace.data != NULL) {
+      const TraceSequence *sequence =
+          &g_trace.sequences[TraceSequenceIndex(b, s, t)];
+      g_replay_begin[t] = g_trace.data + sequence->begin;
+      g_replay_end[t] = g_trace.data + sequence->end;
+    }
+  }
+  Worker workers[kMaxThreads];
+  int thread_ids[kMaxThreads];
+  for (int t = 0; t < thread_count; ++t) {
+    thread_ids[t] = t;
+    int rc;
+    if ((rc = StartWorker(&workers[t], &thread_ids[t]))) {
+      fprintf(stderr, "error: StartWorker, rc: %d\n", rc);
+      return false;
+    }
+  }
+
+  // Wait all the threads are ready
+  pthread_mutex_lock(&global_state.count_mutex);
+  while (global_state.count != thread_count) {
+    pthread_cond_wait(&global_state.count_cond,
+                      &global_state.count_mutex);
+  }
+  pthread_mutex_unlock(&global_state.count_mutex);
+
+  // Start threads
+  pthread_mutex_lock(&global_state.count_mutex);
+  global_state.count = 0;
+  pthread_cond_broadcast(&global_state.count_cond);
+  pthread_mutex_unlock(&global_state.count_mutex);
+#if USE_TIMELINE
+  pthread_t monitor;
+  g_timeline.thread_count = thread_count;
+  g_timeline.sample_count = 0;
+  g_timeline.sample_cost = 0;
+  g_timeline.done = false;
+  pthread_create(&monitor, NULL, MonitorProc, NULL);
+#endif
+  for (int t = 0; t < thread_count; ++t) {
+    JoinWorker(workers[t]);
+  }
+#if USE_TIMELINE
+  __atomic_store_n(&g_timeline.done, true, __ATOMIC_RELEASE);
+  pthread_join(monitor, NULL);
+#endif
+
+  ThreadStats totals = {0};
+  for (int t = 0; t < thread_count; ++t) {
+    ThreadStats *stats = &global_state.thread_stats[t];
+    totals.workdone += stats->workdone;
+    totals.iterations += stats->iterations;
+    totals.overshoot += stats->overshoot;
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+    totals.timeouts += stats->timeouts;
+#endif
+    result->thread_stats[t] = *stats;
+  }
+  result->totals = totals;
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  AcquireHistogram histogram = {{0}};
+  for (int t = 0; t < thread_count; ++t) {
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+      histogram.buckets[i] += global_state.acquire_histograms[t].buckets[i];
+    }
+  }
+  result->acquire_p50_ns = HistogramPercentile(histogram, 0.5f);
+  result->acquire_p99_ns = HistogramPercentile(histogram, 0.99f);
+  result->acquire_p999_ns = HistogramPercentile(histogram, 0.999f);
+#endif
+  return true;
+}
+
+void PrintJsonString(FILE *file, const char *value) {
+  fputc('"', file);
+  for (; *value; ++value) {
+    if (*value == '"' || *value == '\\') {
+      fprintf(file, "\\%c", *value);
+    } else if (static_cast<unsigned char>(*value) < 0x20) {
+      fprintf(file, "\\u%04x", *value);
+    } else {
+      fputc(*value, file);
+    }
+  }
+  fputc('"', file);
+}
+
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+// Share of acquisitions that gave up at the deadline
+float TimeoutRate(const ThreadStats &stats) {
+  uint64_t attempts = stats.iterations + stats.timeouts;
+  return attempts ? static_cast<float>(stats.timeouts) / attempts : 0.0f;
+}
+#endif
+
+// Percentiles are only kept for the whole run, so the per-thread rows
+// leave them empty
+void PrintCsvRow(int run, int partition, const char *thread,
+                 const ThreadStats &stats, const PointResult *result) {
+  int b = RunPoint(run);
+  printf("%d,%e,%f,%d,%d,%s,%llu,%llu,%llu",
+         g_benchmark_params[b].thread_count,
+         g_benchmark_params[b].lock_interval, RunStep(run) * 1.0 / kSteps,
+         RunRepetition(run), partition, thread, stats.workdone,
+         stats.iterations, stats.overshoot);
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  printf(",%llu,%f", stats.timeouts, TimeoutRate(stats));
+  if (result != NULL) {
+    printf(",%.0f,%.0f,%.0f", result->acquire_p50_ns, result->acquire_p99_ns,
+           result->acquire_p999_ns);
+  } else {
+    printf(",,,");
+  }
+#endif
+  printf("\n");
+}
+
+void ReportBenchmarkRun(int run, const PointResult &result) {
+  int b = RunPoint(run);
+  int thread_count = g_benchmark_params[b].thread_count;
+  const ThreadStats &totals = result.totals;
+  if (g_format == kFormatCsv) {
+    PrintCsvRow(run, result.partition, "all", totals, &result);
+    for (int t = 0; t < thread_count; ++t) {
+      char thread[16];
+      snprintf(thread, sizeof(thread), "%d", t);
+      PrintCsvRow(run, result.partition, thread, result.thread_stats[t],
+                  NULL);
+    }
+  } else if (g_format == kFormatJson) {
+    printf("{\"threads\":%d,\"lockInterval\":%e,\"lockDuration\":%f,"
+           "\"repetition\":%d,\"partition\":%d,\"workDone\":%llu,"
+           "\"iterations\":%llu,\"overshoot\":%llu,",
+           thread_count, g_benchmark_params[b].lock_interval,
+           RunStep(run) * 1.0 / kSteps, RunRepetition(run), result.partition,
+           totals.workdone, totals.iterations, totals.overshoot);
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+    printf("\"timeouts\":%llu,\"timeoutRate\":%f,\"acquireP50Ns\":%.0f,"
+           "\"acquireP99Ns\":%.0f,\"acquireP999Ns\":%.0f,",
+           totals.timeouts, TimeoutRate(totals), result.acquire_p50_ns,
+           result.acquire_p99_ns, result.acquire_p999_ns);
+#endif
+    printf("\"perThread\":[");
+    for (int t = 0; t < thread_count; ++t) {
+      printf("%s{\"workDone\":%llu,\"iterations\":%llu,"
+             "\"overshoot\":%llu", t > 0 ? "," : "",
+             result.thread_stats[t].workdone,
+             result.thread_stats[t].iterations,
+             result.thread_stats[t].overshoot);
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+      printf(",\"timeouts\":%llu", result.thread_stats[t].timeouts);
+#endif
+      printf("}");
+    }
+    printf("]}\n");
+  } else {
+    printf("threads=%d ", thread_count);
+    printf("lockInterval=%e ", g_benchmark_params[b].lock_interval);
+    printf("lockDuration=%f ", (RunStep(run) * 1.0 / kSteps));
+    if (kRepetitions > 1) {
+      printf("repetition=%d ", RunRepetition(run));
+    }
+    printf("workDone=%llu ", totals.workdone);
+    printf("iterations=%llu ", totals.iterations);
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+    printf("timeouts=%llu ", totals.timeouts);
+    printf("timeoutRate=%f ", TimeoutRate(totals));
+    printf("acquireP50Ns=%.0f ", result.acquire_p50_ns);
+    printf("acquireP99Ns=%.0f ", result.acquire_p99_ns);
+    printf("acquireP999Ns=%.0f ", result.acquire_p999_ns);
+#endif
+    printf("overshoot=%llu \n", totals.overshoot);
+  }
+}
+
+
+// Sweep scheduling. With --concurrent, independent benchmark points run at
+// the same time on disjoint sets of SWEEP_PARTITION_CPUS cores. A partition
+// takes one CPU of each L2 group, leaving SMT siblings idle, so no two of
+// its threads share a core, as in a serial sweep on the first CPUs. It never
+// spans two L3 domains, so partitions share at most an L3 cache, and with
+// SWEEP_SHARED_L3 0 not even that. Points with more threads than a
+// partition has cores are not measured the way a serial sweep measures
+// them; --validate shows how far the two disagree.
+static const int kMaxPartitions = 256;
+
+struct Partition {
+  int cpu_count;
+  int cpus[kMaxThreads];
+};
+
+float g_cpu_secs_per_work_unit[kMaxCpus];
+
+// Fills in g_cpu_secs_per_work_unit for those of cpus that do not have it
+// yet, from the cache or by measuring. Every L2 group is measured by a
+// thread of its own, so a whole machine takes about as long as one core.
+// Returns false if the threads could not be started.
+bool CalibrateCpus(CalibrationCache *cache, const int *cpus, int cpu_count) {
+  Calibration *calibrations = new Calibration[cpu_count];
+  int *l2 = new int[cpu_count];
+  bool queued[kMaxCpus] = { false };
+  int pending = 0;
+  for (int i = 0; i < cpu_count; ++i) {
+    int cpu = cpus[i];
+    if (g_cpu_secs_per_work_unit[cpu] > 0 || queued[cpu]) {
+      continue;
+    }
+    if (LookupCalibration(cache, cpu, &g_cpu_secs_per_work_unit[cpu])) {
+      fprintf(g_info, "secsPerWorkUnit[cpu%d] = %e (cached)\n", cpu,
+              g_cpu_secs_per_work_unit[cpu]);
+      continue;
+    }
+    queued[cpu] = true;
+    calibrations[pending].cpu = cpu;
+    l2[pending] = CacheDomainOf(cpu, 2);
+    if (l2[pending] < 0) {
+      l2[pending] = cpu;
+    }
+    pending++;
+  }
+
+  // Gather the CPUs of each L2 group next to each other
+  Calibration *ordered = new Calibration[cpu_count];
+  CalibrationGroup *groups = new CalibrationGroup[cpu_count];
+  int group_count = 0;
+  int n = 0;
+  for (int i = 0; i < pending; ++i) {
+    if (l2[i] < 0) {
+      continue;
+    }
+    int domain = l2[i];
+    CalibrationGroup *group = &groups[group_count++];
+    group->count = 0;
+    group->calibrations = &ordered[n];
+    for (int j = i; j < pending; ++j) {
+      if (l2[j] == domain) {
+        ordered[n++] = calibrations[j];
+        group->count++;
+        l2[j] = -1;
+      }
+    }
+  }
+
+  bool ok = true;
+  int started = 0;
+  for (; started < group_count; ++started) {
+    int rc;
+    if ((rc = pthread_create(&groups[started].thread, NULL,
+                             CalibrationGroupProc, &groups[started]))) {
+      fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+      ok = false;
+      break;
+    }
+  }
+  for (int g = 0; g < started; ++g) {
+    pthread_join(groups[g].thread, NULL);
+  }
+  for (int i = 0; ok && i < n; ++i) {
+    int cpu = ordered[i].cpu;
+    g_cpu_secs_per_work_unit[cpu] = ordered[i].secs_per_work_unit;
+    StoreCalibration(cache, cpu, ordered[i].secs_per_work_unit);
+    fprintf(g_info, "secsPerWorkUnit[cpu%d] = %e\n", cpu,
+            g_cpu_secs_per_work_unit[cpu]);
+  }
+  delete[] groups;
+  delete[] ordered;
+  delete[] l2;
+  delete[] calibrations;
+  return ok;
+}
+
+// Thread t of a partition runs on its (t mod n)-th CPU
+void UsePartition(const Partition &partition) {
+  for (int t = 0; t < kMaxThreads; ++t) {
+    int cpu = partition.cpus[t % partition.cpu_count];
+    global_state.thread_cpu[t] = cpu;
+    global_state.secs_per_work_unit[t] = g_cpu_secs_per_work_unit[cpu];
+  }
+}
+
+// Splits the allowed CPUs into partitions of size cores. Returns how many
+// were made; cores left over in an L3 domain stay idle.
+int BuildPartitions(const int *cpus, int cpu_count, int size,
+                    Partition *partitions) {
+  int l3[kMaxCpus];
+  int l2[kMaxCpus];
+  for (int i = 0; i < cpu_count; ++i) {
+    l3[cpus[i]] = L3DomainOf(cpus[i]);
+    l2[cpus[i]] = CacheDomainOf(cpus[i], 2);
+    if (l2[cpus[i]] < 0) {
+      l2[cpus[i]] = cpus[i];
+    }
+  }
+  bool used[kMaxCpus] = { false };
+  int count = 0;
+  for (int i = 0; i < cpu_count && count < kMaxPartitions; ++i) {
+    int domain = l3[cpus[i]];
+    if (used[cpus[i]]) {
+      continue;
+    }
+    // Walk this L3 domain one L2 group at a time
+    Partition *partition = &partitions[count];
+    partition->cpu_count = 0;
+    for (int j = i; j < cpu_count; ++j) {
+      int cpu = cpus[j];
+      if (used[cpu] || l3[cpu] != domain) {
+        continue;
+      }
+      // Take the group's first CPU and leave its siblings idle
+      for (int k = j; k < cpu_count; ++k) {
+        if (l3[cpus[k]] == domain && l2[cpus[k]] == l2[cpu]) {
+          used[cpus[k]] = true;
+        }
+      }
+      partition->cpus[partition->cpu_count++] = cpu;
+      if (partition->cpu_count == size) {
+        count++;
+        if (!SWEEP_SHARED_L3 || count == kMaxPartitions) {
+          break;
         }
+        partition = &partitions[count];
+        partition->cpu_count = 0;
+      }
+    }
+    // Retire the rest of the domain
+    for (int j = i; j < cpu_count; ++j) {
+      if (l3[cpus[j]] == domain) {
+        used[cpus[j]] = true;
+      }
+    }
+  }
+  return count;
+}
+
+// Shared between the parent and the partition runners it forks
+struct SweepState {
+  int next_run;
+  PointResult results[kRuns];
+};
+
+SweepState *MapSweepState() {
+  void *addr = mmap(NULL, sizeof(SweepState), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return static_cast<SweepState*>(addr);
+}
+
+// Body of a forked partition runner: claims runs until none are left.
+void RunPartition(SweepState *sweep, const Partition &partition, int p) {
+#if USE_PROCESSES
+  // The GlobalState mapping inherited from the parent is shared with every
+  // other runner. Replace it with a fresh one at the same address, which
+  // this runner's workers then inherit.
+  if (mmap(&global_state, sizeof(GlobalState), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    perror("mmap");
+    _exit(1);
+  }
+#endif
+  InitGlobalState();
+  UsePartition(partition);
+  for (;;) {
+    int run = __sync_fetch_and_add(&sweep->next_run, 1);
+    if (run >= kRuns) {
+      break;
+    }
+    PointResult *result = &sweep->results[run];
+    if (!RunBenchmarkPoint(RunPoint(run), RunStep(run), result)) {
+      _exit(1);
+    }
+    result->partition = p;
+    __atomic_store_n(&result->done, 1, __ATOMIC_RELEASE);
+    FutexWake(&result->done, 1);
+  }
+  DestroyGlobalState();
+}
+
+// Kills the runners that have not been reaped yet, along with the workers
+// they forked, and reaps them. Each runner leads its own process group.
+void StopRunners(pid_t *runners, int count) {
+  for (int p = 0; p < count; ++p) {
+    if (runners[p] > 0) {
+      kill(-runners[p], SIGKILL);
+    }
+  }
+  for (int p = 0; p < count; ++p) {
+    if (runners[p] > 0) {
+      waitpid(runners[p], NULL, 0);
+      runners[p] = 0;
+    }
+  }
+}
 
-        cpu_set_t cpus;
-        CPU_ZERO(&cpus);
-        CPU_SET(t, &cpus);
-        pthread_setaffinity_np(threads[t], sizeof(cpu_set_t), &cpus);
+// Runs the sweep on all partitions at once and prints the runs in order
+// as they complete. Returns false, with every runner stopped, if one died.
+bool RunConcurrentSweep(SweepState *sweep, const Partition *partitions,
+                        int partition_count) {
+  pid_t runners[kMaxPartitions];
+  fflush(stdout);
+  for (int p = 0; p < partition_count; ++p) {
+    runners[p] = fork();
+    if (runners[p] == 0) {
+      setpgid(0, 0);
+      RunPartition(sweep, partitions[p], p);
+      _exit(0);
+    }
+    if (runners[p] < 0) {
+      perror("fork");
+      StopRunners(runners, p);
+      return false;
+    }
+    // Also from this side, so the group exists before we may kill it
+    setpgid(runners[p], runners[p]);
+  }
+  int running = partition_count;
+  struct timespec timeout = { 0, 100000000 };
+  for (int run = 0; run < kRuns; ++run) {
+    PointResult *result = &sweep->results[run];
+    while (!__atomic_load_n(&result->done, __ATOMIC_ACQUIRE)) {
+      FutexWait(&result->done, 0, &timeout);
+      int status;
+      pid_t pid;
+      while (running > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int p = 0; p < partition_count; ++p) {
+          if (runners[p] == pid) {
+            runners[p] = 0;
+          }
+        }
+        running--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+          fprintf(stderr, "error: partition runner failed\n");
+          StopRunners(runners, partition_count);
+          return false;
+        }
+      }
+      if (running == 0 && !__atomic_load_n(&result->done, __ATOMIC_ACQUIRE)) {
+        return false;
       }
+    }
+    ReportBenchmarkRun(run, *result);
+    fflush(stdout);
+  }
+  while (running > 0 && wait(NULL) > 0) {
+    running--;
+  }
+  return true;
+}
+
+// Reruns an evenly spaced sample of runs one at a time on the CPUs a
+// --serial sweep would use, and compares the work done with the concurrent
+// run. Differences well beyond the run-to-run noise of a serial sweep mean
+// the concurrent sweep does not measure what a serial one does, because
+// the partitions disturb each other or their layout differs.
+void ValidateSweep(SweepState *sweep, const Partition &serial_layout,
+                   int sample_count) {
+  if (sample_count > kRuns) {
+    sample_count = kRuns;
+  }
+  double sum_abs_delta = 0;
+  double max_abs_delta = 0;
+  UsePartition(serial_layout);
+  for (int i = 0; i < sample_count; ++i) {
+    int run = static_cast<int>(static_cast<long long>(i) * kRuns /
+                               sample_count);
+    PointResult *result = &sweep->results[run];
+    PointResult serial;
+    if (!RunBenchmarkPoint(RunPoint(run), RunStep(run), &serial)) {
+      return;
+    }
+    double concurrent_work = result->totals.workdone -
+        result->totals.overshoot;
+    double serial_work = serial.totals.workdone - serial.totals.overshoot;
+    double delta = serial_work > 0 ?
+        (concurrent_work - serial_work) / serial_work : 0;
+    sum_abs_delta += fabs(delta);
+    if (fabs(delta) > max_abs_delta) {
+      max_abs_delta = fabs(delta);
+    }
+    fprintf(g_info, "validate threads=%d ",
+            g_benchmark_params[RunPoint(run)].thread_count);
+    fprintf(g_info, "lockInterval=%e ",
+            g_benchmark_params[RunPoint(run)].lock_interval);
+    fprintf(g_info, "lockDuration=%f ", RunStep(run) * 1.0 / kSteps);
+    fprintf(g_info, "repetition=%d ", RunRepetition(run));
+    fprintf(g_info, "partition=%d ", result->partition);
+    fprintf(g_info, "concurrentWork=%.0f serialWork=%.0f delta=%f \n",
+            concurrent_work, serial_work, delta);
+  }
+  fprintf(g_info, "validation samples=%d meanAbsDelta=%f maxAbsDelta=%f \n",
+          sample_count, sum_abs_delta / sample_count, max_abs_delta);
+}
 
-      // Wait all the threads are ready
-      pthread_mutex_lock(&global_state.count_mutex);
-      while (global_state.count != thread_count) {
-        pthread_cond_wait(&global_state.count_cond,
-                          &global_state.count_mutex);
+
+// Describes the machine and configuration a csv or json result set was
+// measured with: a "# key=value" comment per item before the csv header,
+// or a single {"meta": ...} line ahead of the json runs.
+void ReportMeta(const int *cpus, int cpu_count, const Partition *partitions,
+                int partition_count, bool serial, const char *trace_path) {
+  struct utsname host;
+  uname(&host);
+  char cpu_model[128];
+  ReadCpuModel(cpu_model, sizeof(cpu_model));
+  int l3_ids[kMaxCpus];
+  int l3_count = 0;
+  for (int i = 0; i < cpu_count; ++i) {
+    int id = L3DomainOf(cpus[i]);
+    int d = 0;
+    while (d < l3_count && l3_ids[d] != id) {
+      d++;
+    }
+    if (d == l3_count) {
+      l3_ids[l3_count++] = id;
+    }
+  }
+  const char *strings[][2] = {
+    { "host", host.nodename },
+    { "kernel", host.release },
+    { "cpuModel", cpu_model },
+    { "compiler", "gcc " __VERSION__ },
+    { "lock", kLockName },
+    { "trace", trace_path != NULL ? trace_path : "" },
+  };
+  const int kStrings = sizeof(strings) / sizeof(strings[0]);
+  int cohort_domains = 0;
+#if USE_LOCK == LOCK_COHORT
+  cohort_domains = global_state.thread_mutex.domain_count();
+#endif
+  const char *ints[] = {
+    "processes", "steps", "repetitions", "onlineCpus", "allowedCpus",
+    "l3Domains", "serial", "cohortDomains", "cohortPassBound",
+    "deadlineUs",
+  };
+  int int_values[] = {
+    USE_PROCESSES, kSteps, kRepetitions,
+    static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)), cpu_count, l3_count,
+    serial, cohort_domains, USE_LOCK == LOCK_COHORT ? COHORT_PASS_BOUND : 0,
+    USE_LOCK == LOCK_TIMED_BENAPHORE ? TIMED_LOCK_DEADLINE_US : 0,
+  };
+  const int kInts = sizeof(ints) / sizeof(ints[0]);
+  if (g_format == kFormatCsv) {
+    for (int i = 0; i < kStrings; ++i) {
+      printf("# %s=%s\n", strings[i][0], strings[i][1]);
+    }
+    for (int i = 0; i < kInts; ++i) {
+      printf("# %s=%d\n", ints[i], int_values[i]);
+    }
+    printf("# timeLimit=%f\n", static_cast<float>(BENCHMARK_TIME_LIMIT));
+    for (int p = 0; p < partition_count; ++p) {
+      printf("# partition[%d]=", p);
+      for (int i = 0; i < partitions[p].cpu_count; ++i) {
+        printf("%s%d", i > 0 ? "," : "", partitions[p].cpus[i]);
+      }
+      printf("\n");
+    }
+    for (int p = 0; p < partition_count; ++p) {
+      for (int i = 0; i < partitions[p].cpu_count; ++i) {
+        int cpu = partitions[p].cpus[i];
+        printf("# secsPerWorkUnit[cpu%d]=%e\n", cpu,
+               g_cpu_secs_per_work_unit[cpu]);
+      }
+    }
+    printf("threads,lockInterval,lockDuration,repetition,partition,thread,"
+           "workDone,iterations,overshoot");
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+    printf(",timeouts,timeoutRate,acquireP50Ns,acquireP99Ns,acquireP999Ns");
+#endif
+    printf("\n");
+  } else if (g_format == kFormatJson) {
+    printf("{\"meta\":{");
+    for (int i = 0; i < kStrings; ++i) {
+      printf("\"%s\":", strings[i][0]);
+      PrintJsonString(stdout, strings[i][1]);
+      printf(",");
+    }
+    for (int i = 0; i < kInts; ++i) {
+      printf("\"%s\":%d,", ints[i], int_values[i]);
+    }
+    printf("\"timeLimit\":%f,", static_cast<float>(BENCHMARK_TIME_LIMIT));
+    printf("\"partitions\":[");
+    for (int p = 0; p < partition_count; ++p) {
+      printf("%s[", p > 0 ? "," : "");
+      for (int i = 0; i < partitions[p].cpu_count; ++i) {
+        printf("%s%d", i > 0 ? "," : "", partitions[p].cpus[i]);
       }
-      pthread_mutex_unlock(&global_state.count_mutex);
-
-      // Start threads
-      pthread_mutex_lock(&global_state.count_mutex);
-      global_state.count = 0;
-      pthread_cond_broadcast(&global_state.count_cond);
-      pthread_mutex_unlock(&global_state.count_mutex);
-      for (int t = 0; t < thread_count; ++t) {
-        pthread_join(threads[t], NULL);
+      printf("]");
+    }
+    printf("],\"secsPerWorkUnit\":{");
+    for (int p = 0; p < partition_count; ++p) {
+      for (int i = 0; i < partitions[p].cpu_count; ++i) {
+        int cpu = partitions[p].cpus[i];
+        printf("%s\"%d\":%e", p > 0 || i > 0 ? "," : "", cpu,
+               g_cpu_secs_per_work_unit[cpu]);
       }
+    }
+    printf("}}}\n");
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  // --record writes a workload trace and then replays it, --replay reuses
+  // one, so that every lock type runs exactly the same work unit counts.
+  // Points run one at a time on the first CPUs (--serial, the default)
+  // unless --concurrent runs independent points at once on partitions of
+  // cores; --validate then reruns that many of its runs serially, to check
+  // the two sweeps agree on this machine. --format csv or json
+  // writes structured results to stdout and everything else to stderr.
+  // --stress only runs the mutual-exclusion stress test.
+  const char *trace_path = NULL;
+  bool stress = false;
+  bool record_trace = false;
+  bool serial = true;
+  int validate_count = 0;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "--record") == 0 ||
+         strcmp(argv[i], "--replay") == 0) && i + 1 < argc) {
+      record_trace = strcmp(argv[i], "--record") == 0;
+      trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--serial") == 0) {
+      serial = true;
+    } else if (strcmp(argv[i], "--concurrent") == 0) {
+      serial = USE_TIMELINE;  // The monitor needs the points to itself
+    } else if (strcmp(argv[i], "--stress") == 0) {
+      stress = true;
+    } else if (strcmp(argv[i], "--validate") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      validate_count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc &&
+               (strcmp(argv[i + 1], "text") == 0 ||
+                strcmp(argv[i + 1], "csv") == 0 ||
+                strcmp(argv[i + 1], "json") == 0)) {
+      ++i;
+      g_format = strcmp(argv[i], "csv") == 0 ? kFormatCsv :
+          strcmp(argv[i], "json") == 0 ? kFormatJson : kFormatText;
+    } else {
+      fprintf(stderr, "usage: %s [--record trace | --replay trace] "
+              "[--serial | --concurrent] [--validate runs] "
+              "[--format text|csv|json] "
+              "[--stress]\n", argv[0]);
+      return -1;
+    }
+  }
+  if (g_format != kFormatText) {
+    g_info = stderr;
+  }
+
+  InitGlobalState();
+  if (stress) {
+#if USE_LOCK == LOCK_COHORT
+    fprintf(g_info, "cohortDomains = %d\n",
+            global_state.thread_mutex.domain_count());
+#endif
+    bool ok = RunStressTest();
+    DestroyGlobalState();
+    return ok ? 0 : -1;
+  }
 
-      // Report
-      printf("threads=%d ", thread_count);
-      printf("lockInterval=%e ", g_benchmark_params[b].lock_interval);
-      printf("lockDuration=%f ", (s * 1.0 / kSteps));
-      ThreadStats totals = {0};
-      for (int t = 0; t < thread_count; ++t) {
-        totals.workdone += global_state.thread_stats[t].workdone;
-        totals.iterations += global_state.thread_stats[t].iterations;
-        totals.overshoot += global_state.thread_stats[t].overshoot;
+  cpu_set_t allowed;
+  int cpus[kMaxCpus];
+  int cpu_count = 0;
+  sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpus[cpu_count++] = cpu;
+    }
+  }
+  // A serial run uses the first CPUs we may use
+  Partition serial_layout;
+  serial_layout.cpu_count = min(cpu_count, kMaxThreads);
+  for (int i = 0; i < serial_layout.cpu_count; ++i) {
+    serial_layout.cpus[i] = cpus[i];
+  }
+  Partition *partitions = new Partition[kMaxPartitions];
+  int partition_count = 0;
+  if (!serial) {
+    partition_count = BuildPartitions(cpus, cpu_count, SWEEP_PARTITION_CPUS,
+                                      partitions);
+  }
+  if (partition_count < 2) {
+    serial = true;
+    partition_count = 1;
+    partitions[0] = serial_layout;
+  }
+
+  // Calibrate each CPU of each partition, and those validation runs on
+  int *calibrate = new int[kMaxPartitions * kMaxThreads + kMaxThreads];
+  int calibrate_count = 0;
+  for (int p = 0; p < partition_count; ++p) {
+    for (int i = 0; i < partitions[p].cpu_count; ++i) {
+      calibrate[calibrate_count++] = partitions[p].cpus[i];
+    }
+  }
+  if (!serial && validate_count > 0) {
+    for (int i = 0; i < serial_layout.cpu_count; ++i) {
+      calibrate[calibrate_count++] = serial_layout.cpus[i];
+    }
+  }
+  CalibrationCache *calibration_cache = new CalibrationCache;
+  LoadCalibrationCache(calibration_cache);
+  bool calibrated = CalibrateCpus(calibration_cache, calibrate,
+                                  calibrate_count);
+  SaveCalibrationCache(calibration_cache);
+  delete calibration_cache;
+  delete[] calibrate;
+  if (!calibrated) {
+    delete[] partitions;
+    DestroyGlobalState();
+    return -1;
+  }
+  // The trace is recorded with the first partition's calibration
+  UsePartition(partitions[0]);
+#if USE_LOCK == LOCK_COHORT
+  fprintf(g_info, "cohortDomains = %d, cohortPassBound = %d\n",
+          global_state.thread_mutex.domain_count(), COHORT_PASS_BOUND);
+#endif
+#if USE_LOCK == LOCK_TIMED_BENAPHORE
+  fprintf(g_info, "deadlineUs = %d\n", TIMED_LOCK_DEADLINE_US);
+#endif
+
+  if (trace_path != NULL) {
+    if (record_trace && !RecordTrace(trace_path)) {
+      return -1;
+    }
+    if (!MapTrace(trace_path, &g_trace)) {
+      return -1;
+    }
+    fprintf(g_info, "trace = %s, %d iterations per thread\n", trace_path,
+            reinterpret_cast<const TraceHeader*>(g_trace.data)->iterations);
+  }
+  ReportMeta(cpus, cpu_count, partitions, partition_count, serial,
+             trace_path);
+
+  if (serial) {
+    for (int run = 0; run < kRuns; ++run) {
+      PointResult result;
+      result.partition = 0;
+      if (!RunBenchmarkPoint(RunPoint(run), RunStep(run), &result)) {
+        return -1;
       }
-      printf("workDone=%llu ", totals.workdone);
-      printf("iteratons=%llu ", totals.iterations);
-      printf("overshoot=%llu \n", totals.overshoot);
+      ReportBenchmarkRun(run, result);
+#if USE_TIMELINE
+      ReportTimeline();
+#endif
+    }
+    if (validate_count > 0) {
+      fprintf(g_info, "validation skipped: the sweep ran serially\n");
+    }
+  } else {
+    for (int p = 0; p < partition_count; ++p) {
+      fprintf(g_info, "partition[%d] = cpu", p);
+      for (int i = 0; i < partitions[p].cpu_count; ++i) {
+        fprintf(g_info, "%s%d", i > 0 ? "," : "", partitions[p].cpus[i]);
+      }
+      fprintf(g_info, "\n");
+    }
+    SweepState *sweep = MapSweepState();
+    if (!RunConcurrentSweep(sweep, partitions, partition_count)) {
+      return -1;
+    }
+    if (validate_count > 0) {
+      ValidateSweep(sweep, serial_layout, validate_count);
     }
   }
-  pthread_mutex_destroy(&global_state.thread_mutex);
-  pthread_mutex_destroy(&global_state.count_mutex);
-  pthread_cond_destroy(&global_state.count_cond);
+  delete[] partitions;
+  DestroyGlobalState();
   return 0;
 }
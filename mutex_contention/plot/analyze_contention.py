@@ -4,6 +4,7 @@ import numpy as np
 import matplotlib.pyplot as plt
 import matplotlib
 from matplotlib.ticker import FuncFormatter
+from results import load_results, mean_work
 
 def to_percent(y, position):
     # Ignore the passed in position. This has the effect of scaling the default
@@ -17,36 +18,22 @@ def to_percent(y, position):
         return s + '%'
 
 
-work_list = [[] for i in range(5)]
+THREADS = [1, 2, 3, 4]
 
-with open("contention.txt") as file:
-    for line in file:
-        fields = [line.split(' ')][0]
-        thread_id = fields[0].split('=')[1]
-        workdone = fields[3].split('=')[1]
-        overshoot = fields[5].split('=')[1]
-        work = int(workdone) - int(overshoot)
-        work_list[int(thread_id)].append(work)
-
-
-for i in range(len(work_list[1])):
-    work_list[2][i] = work_list[2][i] * 1.0 / work_list[1][i]
-    work_list[3][i] = work_list[3][i] * 1.0 / work_list[1][i]
-    work_list[4][i] = work_list[4][i] * 1.0 / work_list[1][i]
-    work_list[1][i] = work_list[1][i] * 1.0 / work_list[1][i]
-
-x = []
-for i in range(len(work_list[1])):
-    x.append(i * 0.005)
+meta, runs = load_results("contention.txt")
+x, single = mean_work(runs, 1)
+work_list = []
+for threads in THREADS:
+    durations, works = mean_work(runs, threads)
+    work_list.append([w * 1.0 / b for w, b in zip(works, single)])
 
 fig, ax = plt.subplots()
 
-line1 = ax.plot(np.array(x), np.array(work_list[1]), linewidth=2)
-line2 = ax.plot(np.array(x), np.array(work_list[2]), linewidth=2)
-line3 = ax.plot(np.array(x), np.array(work_list[3]), linewidth=2)
-line4 = ax.plot(np.array(x), np.array(work_list[4]), linewidth=2)
-ax.legend( (line1[0], line2[0], line3[0], line4[0]),
-           ('thread1', 'thread2', 'thread3', 'thread4'))
+line_list = []
+for i in range(len(THREADS)):
+    line_list.append(ax.plot(np.array(x), np.array(work_list[i]), linewidth=2))
+ax.legend([line[0] for line in line_list],
+          ['thread%d' % threads for threads in THREADS])
 
 formatter = FuncFormatter(to_percent)
 ax.xaxis.set_major_formatter(formatter)
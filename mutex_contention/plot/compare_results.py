@@ -0,0 +1,244 @@
+#!/usr/bin/env python
+"""Compares two lock_benchmark result sets point by point.
+
+Every (threads, lockInterval, lockDuration) point present in both sets is
+compared on each metric with Welch's t-test over the repetitions, and the
+p-values are corrected for the number of comparisons with the
+Benjamini-Hochberg procedure. A point is a regression when the candidate is
+worse by more than --threshold and the corrected p-value is below --alpha.
+Build lock_benchmark with -DBENCHMARK_REPETITIONS=5 or so; points with fewer
+than two repetitions on either side cannot be tested and are only counted.
+
+Throughput metrics (work, iterations) are better when higher; latency
+metrics, any numeric field whose name ends in "Ns", are better when lower,
+and so is the timed benaphore's timeoutRate.
+
+Exits with 1 if there is a regression, 2 if the sets have no point in
+common, and 0 otherwise, so it can gate a lock library upgrade:
+
+    ./lock_benchmark --format json > before.json
+    (upgrade)
+    ./lock_benchmark --format json > after.json
+    python compare_results.py before.json after.json
+"""
+
+import argparse
+import math
+import sys
+
+from results import load_results, work
+
+THROUGHPUT_METRICS = {
+    'work': work,
+    'iterations': lambda run: run['iterations'],
+}
+
+
+LOWER_IS_BETTER_METRICS = set(['timeoutRate'])
+
+
+def is_lower_better_metric(name):
+    return name.endswith('Ns') or name in LOWER_IS_BETTER_METRICS
+
+
+def metric_value(run, name):
+    if name in THROUGHPUT_METRICS:
+        return THROUGHPUT_METRICS[name](run)
+    return run.get(name)
+
+
+def available_metrics(runs):
+    names = set(THROUGHPUT_METRICS)
+    for run in runs:
+        for key, value in run.items():
+            if is_lower_better_metric(key) and \
+                    isinstance(value, (int, float)):
+                names.add(key)
+    return names
+
+
+def _beta_continued_fraction(a, b, x):
+    # Lentz's method, as in Numerical Recipes' betacf
+    tiny = 1e-300
+    c = 1.0
+    d = 1.0 - (a + b) * x / (a + 1.0)
+    d = 1.0 / (d if abs(d) > tiny else tiny)
+    h = d
+    for m in range(1, 300):
+        m2 = 2 * m
+        aa = m * (b - m) * x / ((a + m2 - 1.0) * (a + m2))
+        d = 1.0 + aa * d
+        d = 1.0 / (d if abs(d) > tiny else tiny)
+        c = 1.0 + aa / c
+        c = c if abs(c) > tiny else tiny
+        h *= d * c
+        aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1.0))
+        d = 1.0 + aa * d
+        d = 1.0 / (d if abs(d) > tiny else tiny)
+        c = 1.0 + aa / c
+        c = c if abs(c) > tiny else tiny
+        delta = d * c
+        h *= delta
+        if abs(delta - 1.0) < 1e-12:
+            break
+    return h
+
+
+def regularized_incomplete_beta(a, b, x):
+    if x <= 0.0:
+        return 0.0
+    if x >= 1.0:
+        return 1.0
+    log_front = (math.lgamma(a + b) - math.lgamma(a) - math.lgamma(b) +
+                 a * math.log(x) + b * math.log(1.0 - x))
+    if x < (a + 1.0) / (a + b + 2.0):
+        return math.exp(log_front) * _beta_continued_fraction(a, b, x) / a
+    return 1.0 - (math.exp(log_front) *
+                  _beta_continued_fraction(b, a, 1.0 - x) / b)
+
+
+def mean_and_variance(samples):
+    mean = sum(samples) / float(len(samples))
+    variance = sum((x - mean) ** 2 for x in samples) / (len(samples) - 1.0)
+    return mean, variance
+
+
+def welch_p_value(a, b):
+    """Two-sided p-value of Welch's t-test, for samples of size >= 2."""
+    mean_a, var_a = mean_and_variance(a)
+    mean_b, var_b = mean_and_variance(b)
+    se2_a = var_a / len(a)
+    se2_b = var_b / len(b)
+    if se2_a + se2_b == 0.0:
+        return 1.0 if mean_a == mean_b else 0.0
+    t = (mean_a - mean_b) / math.sqrt(se2_a + se2_b)
+    df = (se2_a + se2_b) ** 2 / (
+        (se2_a ** 2 / (len(a) - 1) if se2_a > 0 else 0.0) +
+        (se2_b ** 2 / (len(b) - 1) if se2_b > 0 else 0.0))
+    return regularized_incomplete_beta(df / 2.0, 0.5, df / (df + t * t))
+
+
+def benjamini_hochberg(p_values):
+    """Returns the adjusted p-values, in the same order."""
+    order = sorted(range(len(p_values)), key=lambda i: p_values[i])
+    adjusted = [0.0] * len(p_values)
+    running_min = 1.0
+    for rank in range(len(order), 0, -1):
+        i = order[rank - 1]
+        running_min = min(running_min, p_values[i] * len(p_values) / rank)
+        adjusted[i] = running_min
+    return adjusted
+
+
+def point_key(run):
+    return (run['threads'], '%e' % run['lockInterval'],
+            '%f' % run['lockDuration'])
+
+
+def group_by_point(runs):
+    points = {}
+    for run in runs:
+        points.setdefault(point_key(run), []).append(run)
+    return points
+
+
+def describe(meta):
+    fields = ('lock', 'host', 'cpuModel', 'kernel', 'compiler', 'repetitions')
+    return ' '.join('%s=%s' % (key, meta[key]) for key in fields
+                    if key in meta)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Flag statistically significant regressions between '
+                    'two lock_benchmark result sets.')
+    parser.add_argument('baseline')
+    parser.add_argument('candidate')
+    parser.add_argument('--alpha', type=float, default=0.05,
+                        help='false discovery rate (default 0.05)')
+    parser.add_argument('--threshold', type=float, default=0.02,
+                        help='smallest relative change that counts '
+                             '(default 0.02)')
+    parser.add_argument('--metric', action='append',
+                        help='metric to compare, may be repeated '
+                             '(default: all)')
+    parser.add_argument('--all', action='store_true',
+                        help='print every comparison, not just the '
+                             'significant ones')
+    args = parser.parse_args()
+
+    baseline_meta, baseline_runs = load_results(args.baseline)
+    candidate_meta, candidate_runs = load_results(args.candidate)
+    print('baseline: %s %s' % (args.baseline, describe(baseline_meta)))
+    print('candidate: %s %s' % (args.candidate, describe(candidate_meta)))
+    baseline = group_by_point(baseline_runs)
+    candidate = group_by_point(candidate_runs)
+    keys = sorted(set(baseline) & set(candidate),
+                  key=lambda key: (key[0], float(key[1]), float(key[2])))
+    if not keys:
+        print('no benchmark point in common')
+        return 2
+
+    metrics = available_metrics(baseline_runs) & \
+        available_metrics(candidate_runs)
+    if args.metric:
+        metrics &= set(args.metric)
+    metrics = sorted(metrics)
+
+    comparisons = []
+    untested = 0
+    for key in keys:
+        for name in metrics:
+            a = [metric_value(run, name) for run in baseline[key]]
+            b = [metric_value(run, name) for run in candidate[key]]
+            a = [float(x) for x in a if x is not None]
+            b = [float(x) for x in b if x is not None]
+            if not a or not b:
+                continue
+            mean_a = sum(a) / len(a)
+            mean_b = sum(b) / len(b)
+            change = (mean_b - mean_a) / mean_a if mean_a else 0.0
+            if is_lower_better_metric(name):
+                change = -change  # Positive is always an improvement
+            p_value = None
+            if len(a) >= 2 and len(b) >= 2:
+                p_value = welch_p_value(a, b)
+            else:
+                untested += 1
+            comparisons.append([key, name, mean_a, mean_b, change, p_value])
+
+    tested = [c for c in comparisons if c[5] is not None]
+    for c, q in zip(tested, benjamini_hochberg([c[5] for c in tested])):
+        c[5] = q
+
+    regressions = 0
+    improvements = 0
+    for key, name, mean_a, mean_b, change, q in comparisons:
+        significant = q is not None and q < args.alpha and \
+            abs(change) > args.threshold
+        if significant and change < 0:
+            verdict = 'REGRESSION'
+            regressions += 1
+        elif significant:
+            verdict = 'improvement'
+            improvements += 1
+        elif args.all:
+            verdict = 'same' if q is not None else 'untested'
+        else:
+            continue
+        print('%s threads=%d lockInterval=%s lockDuration=%s metric=%s '
+              'baseline=%g candidate=%g change=%+.2f%% q=%s' %
+              (verdict, key[0], key[1], key[2], name, mean_a, mean_b,
+               100 * change, '%.3g' % q if q is not None else '-'))
+
+    print('points=%d metrics=%s regressions=%d improvements=%d '
+          'untested=%d' % (len(keys), ','.join(metrics), regressions,
+                           improvements, untested))
+    if untested:
+        print('note: %d comparisons had fewer than 2 repetitions; build '
+              'with -DBENCHMARK_REPETITIONS=5 to test them' % untested)
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,130 @@
+"""Loads lock_benchmark results in any of its output formats.
+
+Text output has one "key=value ..." line per run, csv output has "# key=value"
+metadata comments followed by a header row and one row per run and thread,
+and json output has a {"meta": ...} line followed by one object per run.
+Older text results spell iterations as "iteratons"; both are accepted.
+
+load_results() returns (meta, runs). Each run is a dict with at least
+threads, lockInterval, lockDuration, repetition, workDone, iterations and
+overshoot, plus perThread (a list of dicts) when the format carries it.
+"""
+
+import csv
+import json
+
+KEY_ALIASES = {'iteratons': 'iterations'}
+
+
+def _number(value):
+    try:
+        return int(value)
+    except ValueError:
+        try:
+            return float(value)
+        except ValueError:
+            return value
+
+
+def _normalize(run):
+    run = dict((KEY_ALIASES.get(key, key), value)
+               for key, value in run.items())
+    run.setdefault('repetition', 0)
+    return run
+
+
+def parse_text_line(line):
+    """Returns the key=value fields of one text line as a dict."""
+    fields = {}
+    for field in line.split():
+        if '=' in field:
+            key, value = field.split('=', 1)
+            fields[key] = _number(value)
+    return fields
+
+
+def _load_text(lines):
+    runs = []
+    for line in lines:
+        fields = parse_text_line(line)
+        # Skip calibration, timeline and validation lines
+        if 'lockInterval' in fields and 'workDone' in fields and \
+                not line.startswith(('timeline', 'validate')):
+            runs.append(_normalize(fields))
+    return {}, runs
+
+
+def _load_json(lines):
+    meta = {}
+    runs = []
+    for line in lines:
+        line = line.strip()
+        if not line.startswith('{'):
+            continue
+        record = json.loads(line)
+        if 'meta' in record:
+            meta = record['meta']
+        else:
+            runs.append(_normalize(record))
+    return meta, runs
+
+
+def _load_csv(lines):
+    meta = {}
+    rows = []
+    for line in lines:
+        if line.startswith('#'):
+            if '=' in line:
+                key, value = line[1:].strip().split('=', 1)
+                meta[key] = _number(value)
+        elif line.strip():
+            rows.append(line)
+    runs = []
+    by_key = {}
+    for row in csv.DictReader(rows):
+        row = dict((key, _number(value)) for key, value in row.items())
+        key = (row['threads'], row['lockInterval'], row['lockDuration'],
+               row['repetition'])
+        thread = row.pop('thread')
+        if thread == 'all':
+            run = _normalize(row)
+            run['perThread'] = []
+            by_key[key] = run
+            runs.append(run)
+        else:
+            by_key[key]['perThread'].append(_normalize(row))
+    return meta, runs
+
+
+def load_results(path):
+    with open(path) as file:
+        lines = file.readlines()
+    first = next((line for line in lines if line.strip()), '')
+    if first.startswith('{'):
+        return _load_json(lines)
+    if first.startswith('#') or first.startswith('threads,'):
+        return _load_csv(lines)
+    return _load_text(lines)
+
+
+def work(run):
+    """Work units done within the time limit."""
+    return run['workDone'] - run['overshoot']
+
+
+def mean_work(runs, threads, lock_interval=None):
+    """Returns (lockDurations, works) for the runs with the given thread
+    count, and lock interval if one is given, sorted by lockDuration. The
+    repetitions of a point are averaged into one work value."""
+    by_duration = {}
+    for run in runs:
+        if run['threads'] != threads:
+            continue
+        if lock_interval is not None and \
+                '%e' % run['lockInterval'] != '%e' % lock_interval:
+            continue
+        by_duration.setdefault(run['lockDuration'], []).append(work(run))
+    durations = sorted(by_duration)
+    works = [sum(by_duration[duration]) * 1.0 / len(by_duration[duration])
+             for duration in durations]
+    return durations, works
@@ -0,0 +1,402 @@
+#include <semaphore.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <ctime>
+#include <cstdio>
+
+// Use restartable sequences when the kernel and glibc (2.35+) provide
+// them; 0 always takes the per-thread shard fallback. Older glibc has no
+// <sys/rseq.h>, and compilers before GCC 11 do not take asm goto with
+// outputs, so the default falls back at compile time there.
+#ifndef USE_RSEQ
+#if defined(__has_include)
+#if __has_include(<sys/rseq.h>) && (__GNUC__ >= 11 || __clang_major__ >= 11)
+#define USE_RSEQ 1
+#endif
+#endif
+#endif
+#ifndef USE_RSEQ
+#define USE_RSEQ 0
+#endif
+
+#if USE_RSEQ
+#include <sys/rseq.h>
+#endif
+
+#define LIGHT_ASSERT(x) { if (!(x)) __builtin_trap(); }
+
+
+void GetMonotonicTime(struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+float GetElapsedTime(struct timespec *before, struct timespec *after) {
+  double delta_s = after->tv_sec - before->tv_sec;
+  double delta_ns = after->tv_nsec - before->tv_nsec;
+  return delta_s * 1e9 + delta_ns;
+}
+
+
+// The shared counter of benaphore_recur_test.cc, guarded by a mutex
+class MutexCounter {
+ public:
+  MutexCounter() : value_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+  ~MutexCounter() {
+    pthread_mutex_destroy(&mutex_);
+  }
+  void Add(int64_t value) {
+    pthread_mutex_lock(&mutex_);
+    value_ += value;
+    pthread_mutex_unlock(&mutex_);
+  }
+  int64_t Read() {
+    pthread_mutex_lock(&mutex_);
+    int64_t value = value_;
+    pthread_mutex_unlock(&mutex_);
+    return value;
+  }
+
+ private:
+  pthread_mutex_t mutex_;
+  int64_t value_;
+};
+
+class Benaphore {
+ public:
+  Benaphore() : counter_(0) {
+    sem_init(&semaphore_, 0, 0);
+  }
+  ~Benaphore() {
+    sem_destroy(&semaphore_);
+  }
+  void Lock() {
+    if (__sync_add_and_fetch(&counter_, 1) > 1) {
+      sem_wait(&semaphore_);
+    }
+  }
+  void Unlock() {
+    if (__sync_sub_and_fetch(&counter_, 1) > 0) {
+      sem_post(&semaphore_);
+    }
+  }
+
+ private:
+  long counter_;
+  sem_t semaphore_;
+};
+
+class BenaphoreCounter {
+ public:
+  BenaphoreCounter() : value_(0) {
+  }
+  void Add(int64_t value) {
+    lock_.Lock();
+    value_ += value;
+    lock_.Unlock();
+  }
+  int64_t Read() {
+    lock_.Lock();
+    int64_t value = value_;
+    lock_.Unlock();
+    return value;
+  }
+
+ private:
+  Benaphore lock_;
+  int64_t value_;
+};
+
+// One lock xadd per increment; still a single cache line for every core
+class AtomicCounter {
+ public:
+  AtomicCounter() : value_(0) {
+  }
+  void Add(int64_t value) {
+    __sync_fetch_and_add(&value_, value);
+  }
+  int64_t Read() {
+    return __atomic_load_n(&value_, __ATOMIC_RELAXED);
+  }
+
+ private:
+  int64_t value_;
+};
+
+__thread int t_shard = -1;
+__thread uint64_t t_rseq_aborts = 0;
+
+#if USE_RSEQ
+// glibc registers an rseq area for every thread at the thread pointer plus
+// __rseq_offset, and leaves __rseq_size at 0 if the kernel refused it.
+struct rseq *RseqArea() {
+  return reinterpret_cast<struct rseq *>(
+      static_cast<char *>(__builtin_thread_pointer()) + __rseq_offset);
+}
+
+// Adds count to *slot if this thread is still running on cpu, and returns
+// false otherwise. If the thread is preempted, migrated or signalled
+// between the cpu check and the add, the kernel moves it to the abort
+// label instead of letting it finish, so the add itself does not have to
+// be atomic.
+//
+// The descriptor in __rseq_cs gives the kernel the start, length and abort
+// address of the sequence; the abort address has to be preceded by
+// RSEQ_SIG.
+static inline bool RseqAddOnCpu(int64_t *slot, int64_t count, int cpu) {
+  struct rseq *rs = RseqArea();
+  __asm__ __volatile__ goto (
+      ".pushsection __rseq_cs, \"aw\"\n\t"
+      ".balign 32\n\t"
+      "3:\n\t"
+      ".long 0x0, 0x0\n\t"
+      ".quad 1f, (2f - 1f), 4f\n\t"
+      ".popsection\n\t"
+      "leaq 3b(%%rip), %%rax\n\t"
+      "movq %%rax, %[rseq_cs]\n\t"
+      "1:\n\t"
+      "cmpl %[cpu], %[current_cpu]\n\t"
+      "jnz 4f\n\t"
+      "addq %[count], %[slot]\n\t"
+      "2:\n\t"
+      ".pushsection __rseq_failure, \"ax\"\n\t"
+      ".long 0x53053053\n\t"
+      "4:\n\t"
+      "jmp %l[abort]\n\t"
+      ".popsection\n\t"
+      : [slot] "+m" (*slot),
+        [rseq_cs] "=m" (rs->rseq_cs)
+      : [cpu] "r" (cpu),
+        [current_cpu] "m" (rs->cpu_id),
+        [count] "er" (count)
+      : "memory", "cc", "rax"
+      : abort);
+  return true;
+abort:
+  return false;
+}
+
+bool RseqAvailable() {
+  return __rseq_size > 0 &&
+      static_cast<int>(__atomic_load_n(&RseqArea()->cpu_id,
+                                        __ATOMIC_RELAXED)) >= 0;
+}
+#else
+bool RseqAvailable() {
+  return false;
+}
+#endif
+
+// Returns one more than the highest CPU id the kernel may ever report.
+// CPU ids can be sparse, so this is not the number of CPUs; the last
+// number in the possible list ("0-7" or "0,2,4-6") is the highest id.
+int PossibleCpuCount() {
+  FILE *file = fopen("/sys/devices/system/cpu/possible", "r");
+  if (file == NULL) {
+    return CPU_SETSIZE;
+  }
+  int highest = -1;
+  int value;
+  char separator;
+  while (fscanf(file, "%d", &value) == 1) {
+    if (value > highest) {
+      highest = value;
+    }
+    if (fscanf(file, "%c", &separator) != 1) {
+      break;
+    }
+  }
+  fclose(file);
+  return highest >= 0 ? highest + 1 : CPU_SETSIZE;
+}
+
+// A counter split into one slot per CPU, each on its own cache line, so
+// increments from different cores never touch the same line. With rseq
+// the slot of the current CPU is updated by a plain add inside a
+// restartable sequence. Without it, every thread claims a slot of its own
+// and is then its only writer; threads beyond kMaxShards all share one
+// overflow slot of their own, which they update with atomic adds.
+//
+// Read() sums the slots. It does not stop concurrent Add()s, so it returns
+// some value between the counter's value when Read() started and when it
+// finished.
+class PerCpuCounter {
+ public:
+  static const int kMaxShards = 256;
+
+  PerCpuCounter() : next_shard_(0) {
+    rseq_ = RseqAvailable();
+    slot_count_ = rseq_ ? PossibleCpuCount() : kMaxShards;
+    slots_ = new Slot[slot_count_];
+    for (int i = 0; i < slot_count_; ++i) {
+      slots_[i].value = 0;
+    }
+    overflow_.value = 0;
+  }
+  ~PerCpuCounter() {
+    delete[] slots_;
+  }
+  void Add(int64_t value) {
+#if USE_RSEQ
+    if (rseq_) {
+      for (;;) {
+        int cpu = __atomic_load_n(&RseqArea()->cpu_id_start,
+                                  __ATOMIC_RELAXED);
+        if (RseqAddOnCpu(&slots_[cpu].value, value, cpu)) {
+          return;
+        }
+        t_rseq_aborts++;
+      }
+    }
+#endif
+    // Shards are handed out per thread, not per counter, which is enough
+    // for a benchmark with one counter at a time
+    if (t_shard < 0) {
+      t_shard = __sync_fetch_and_add(&next_shard_, 1);
+    }
+    if (t_shard < kMaxShards) {
+      // Single writer: a relaxed load and store is a plain add on x86
+      int64_t *slot = &slots_[t_shard].value;
+      __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value,
+                       __ATOMIC_RELAXED);
+    } else {
+      __sync_fetch_and_add(&overflow_.value, value);
+    }
+  }
+  int64_t Read() {
+    int64_t sum = __atomic_load_n(&overflow_.value, __ATOMIC_RELAXED);
+    int used = rseq_ ? slot_count_ :
+        __atomic_load_n(&next_shard_, __ATOMIC_RELAXED);
+    for (int i = 0; i < used && i < slot_count_; ++i) {
+      sum += __atomic_load_n(&slots_[i].value, __ATOMIC_RELAXED);
+    }
+    return sum;
+  }
+  bool uses_rseq() const {
+    return rseq_;
+  }
+
+ private:
+  struct Slot {
+    int64_t value;
+  } __attribute__((aligned(64)));
+
+  bool rseq_;
+  int slot_count_;
+  int next_shard_;
+  Slot *slots_;
+  Slot overflow_;
+};
+
+
+const int kMaxThreads = 16;
+const int kN = 2000000;
+
+struct ThreadResult {
+  float elapsed_ns;
+  uint64_t rseq_aborts;
+};
+
+template <class Counter>
+struct BenchmarkState {
+  Counter *counter;
+  int thread_count;
+  int ready;
+  ThreadResult results[kMaxThreads];
+};
+
+template <class Counter>
+struct ThreadArg {
+  BenchmarkState<Counter> *state;
+  int thread_number;
+};
+
+template <class Counter>
+void *ThreadProc(void *param) {
+  ThreadArg<Counter> *arg = static_cast<ThreadArg<Counter> *>(param);
+  BenchmarkState<Counter> *state = arg->state;
+  int thread_number = arg->thread_number;
+  t_shard = -1;
+  t_rseq_aborts = 0;
+  // Start together, so that the threads actually contend
+  __sync_fetch_and_add(&state->ready, 1);
+  while (__atomic_load_n(&state->ready, __ATOMIC_ACQUIRE) <
+         state->thread_count) {
+    sched_yield();
+  }
+  struct timespec start, end;
+  GetMonotonicTime(&start);
+  for (int i = 0; i < kN; ++i) {
+    state->counter->Add(thread_number + 1);
+  }
+  GetMonotonicTime(&end);
+  state->results[thread_number].elapsed_ns = GetElapsedTime(&start, &end);
+  state->results[thread_number].rseq_aborts = t_rseq_aborts;
+  return NULL;
+}
+
+template <class Counter>
+void PerformBenchmark(const char *name, int thread_count) {
+  Counter counter;
+  BenchmarkState<Counter> state;
+  state.counter = &counter;
+  state.thread_count = thread_count;
+  state.ready = 0;
+  long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t threads[kMaxThreads];
+  ThreadArg<Counter> args[kMaxThreads];
+  for (int t = 0; t < thread_count; ++t) {
+    args[t].state = &state;
+    args[t].thread_number = t;
+    int rc;
+    rc = pthread_create(&threads[t], NULL, ThreadProc<Counter>, &args[t]);
+    if (rc) {
+      fprintf(stderr, "error: pthread_create, rc: %d\n", rc);
+      return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(t % cpu_count, &cpus);
+    pthread_setaffinity_np(threads[t], sizeof(cpu_set_t), &cpus);
+  }
+  for (int t = 0; t < thread_count; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+
+  float slowest_ns = 0;
+  uint64_t rseq_aborts = 0;
+  int64_t expected = 0;
+  for (int t = 0; t < thread_count; ++t) {
+    if (state.results[t].elapsed_ns > slowest_ns) {
+      slowest_ns = state.results[t].elapsed_ns;
+    }
+    rseq_aborts += state.results[t].rseq_aborts;
+    expected += static_cast<int64_t>(t + 1) * kN;
+  }
+  struct timespec start, end;
+  GetMonotonicTime(&start);
+  int64_t value = counter.Read();
+  GetMonotonicTime(&end);
+  LIGHT_ASSERT(value == expected);
+  printf("counter=%s threads=%d addNs=%e addsPerSec=%e readNs=%e "
+         "rseqAborts=%" PRIu64 "\n", name, thread_count,
+         slowest_ns / kN, thread_count * kN / (slowest_ns * 1e-9),
+         GetElapsedTime(&start, &end), rseq_aborts);
+}
+
+
+int main(int argc, char *argv[]) {
+  PerCpuCounter probe;
+  printf("perCpuCounter uses %s\n",
+         probe.uses_rseq() ? "rseq" : "per-thread shards");
+  for (int thread_count = 1; thread_count <= kMaxThreads; thread_count *= 2) {
+    PerformBenchmark<MutexCounter>("mutex", thread_count);
+    PerformBenchmark<BenaphoreCounter>("benaphore", thread_count);
+    PerformBenchmark<AtomicCounter>("atomic", thread_count);
+    PerformBenchmark<PerCpuCounter>("perCpu", thread_count);
+  }
+  return 0;
+}